@@ -0,0 +1,632 @@
+/**
+ * @file bcache.c
+ * @brief sector buffer cache with CLOCK eviction and write-back
+ */
+
+#include <stdlib.h>
+#include <string.h>   // memcpy()
+#include <inttypes.h>
+#include <pthread.h>
+#include "bcache.h"
+#include "sector.h"
+#include "error.h"
+
+#define BCACHE_NONE (-1)
+
+/**
+ * @brief hash bucket of a sector
+ */
+static uint32_t bcache_bucket(const struct bcache *c, uint32_t sector) {
+
+    return (sector * UINT32_C(2654435761)) & c->bucket_mask;
+
+}
+
+struct bcache *bcache_alloc(struct blockdev *dev, size_t capacity) {
+
+    if (dev == NULL || capacity == 0 || capacity > INT32_MAX)
+        return NULL;
+
+    struct bcache *c = calloc(1, sizeof(struct bcache));
+
+    if (c == NULL)
+        return NULL;
+
+    if (pthread_mutex_init(&(c->lock), NULL) != 0) {
+
+        free(c);
+
+        return NULL;
+
+    }
+
+    if (pthread_mutex_init(&(c->io_lock), NULL) != 0) {
+
+        pthread_mutex_destroy(&(c->lock));
+        free(c);
+
+        return NULL;
+
+    }
+
+    if (pthread_cond_init(&(c->written), NULL) != 0) {
+
+        pthread_mutex_destroy(&(c->io_lock));
+        pthread_mutex_destroy(&(c->lock));
+        free(c);
+
+        return NULL;
+
+    }
+
+    size_t nbBuckets = 1;
+
+    while (nbBuckets < capacity)
+        nbBuckets <<= 1;
+
+    c->dev = dev;
+    c->capacity = capacity;
+    c->stats.capacity = capacity;
+    c->bucket_mask = (uint32_t) (nbBuckets - 1);
+    c->dirty_limit = (capacity + BCACHE_DIRTY_RATIO - 1) / BCACHE_DIRTY_RATIO;
+    c->buckets = malloc(nbBuckets * sizeof(int32_t));
+    c->entries = calloc(capacity, sizeof(struct bcache_entry));
+    c->order = malloc(capacity * sizeof(struct bcache_dirty));
+    c->staging = malloc(capacity * SECTOR_SIZE);
+
+    if (c->buckets == NULL || c->entries == NULL || c->order == NULL || c->staging == NULL) {
+
+        bcache_free(c);
+
+        return NULL;
+
+    }
+
+    for (size_t i = 0; i < nbBuckets; i++)
+        c->buckets[i] = BCACHE_NONE;
+
+    return c;
+
+}
+
+void bcache_free(struct bcache *c) {
+
+    if (c == NULL)
+        return;
+
+    pthread_cond_destroy(&(c->written));
+    pthread_mutex_destroy(&(c->io_lock));
+    pthread_mutex_destroy(&(c->lock));
+    free(c->buckets);
+    free(c->entries);
+    free(c->order);
+    free(c->staging);
+    free(c);
+
+}
+
+/**
+ * @brief find the entry holding sector, NULL if it is not cached
+ */
+static struct bcache_entry *bcache_lookup(struct bcache *c, uint32_t sector) {
+
+    for (int32_t i = c->buckets[bcache_bucket(c, sector)]; i != BCACHE_NONE; i = c->entries[i].next) {
+
+        if (c->entries[i].sector == sector)
+            return &(c->entries[i]);
+
+    }
+
+    return NULL;
+
+}
+
+/**
+ * @brief remove a valid entry from its hash bucket
+ */
+static void bcache_unhash(struct bcache *c, struct bcache_entry *e) {
+
+    int32_t index = (int32_t) (e - c->entries);
+    int32_t *link = &(c->buckets[bcache_bucket(c, e->sector)]);
+
+    while (*link != index)
+        link = &(c->entries[*link].next);
+
+    *link = e->next;
+    e->valid = 0;
+
+}
+
+/**
+ * @brief qsort() comparator of dirty entries by sector number
+ */
+static int bcache_compare_sectors(const void *a, const void *b) {
+
+    uint32_t sa = ((const struct bcache_dirty *) a)->sector;
+    uint32_t sb = ((const struct bcache_dirty *) b)->sector;
+
+    return (sa > sb) - (sa < sb);
+
+}
+
+/**
+ * @brief write every dirty entry back, in sector order, merging contiguous
+ *        sectors into one device write. Called with the lock of c held, which
+ *        is released during the writes; one write-back runs at a time.
+ * @return 0 on success; <0 on error (the entries not written stay dirty)
+ */
+static int bcache_writeback(struct bcache *c) {
+
+    while (c->writing)
+        pthread_cond_wait(&(c->written), &(c->lock));
+
+    size_t nbDirty = 0;
+
+    for (size_t i = 0; i < c->capacity; i++) {
+
+        if (c->entries[i].valid && c->entries[i].dirty) {
+            c->order[nbDirty].sector = c->entries[i].sector;
+            c->order[nbDirty].index = (int32_t) i;
+            nbDirty++;
+        }
+
+    }
+
+    if (nbDirty == 0)
+        return ERR_NONE;
+
+    qsort(c->order, nbDirty, sizeof(struct bcache_dirty), bcache_compare_sectors);
+
+    // a copy of what is written: the entries may be written again meanwhile
+    for (size_t i = 0; i < nbDirty; i++) {
+        const struct bcache_entry *e = &(c->entries[c->order[i].index]);
+        c->order[i].version = e->version;
+        memcpy(c->staging + i * SECTOR_SIZE, e->data, SECTOR_SIZE);
+    }
+
+    c->writing = 1;
+
+    int ret = ERR_NONE;
+
+    for (size_t i = 0; i < nbDirty && ret == ERR_NONE; ) {
+
+        size_t run = 1;
+
+        while (i + run < nbDirty && c->order[i + run].sector == c->order[i + run - 1].sector + 1)
+            run++;
+
+        pthread_mutex_unlock(&(c->lock));
+        ret = blockdev_write(c->dev, c->order[i].sector, (uint32_t) run, c->staging + i * SECTOR_SIZE);
+        pthread_mutex_lock(&(c->lock));
+
+        if (ret != ERR_NONE)
+            break;
+
+        // dirty entries are never evicted: the entry still holds the sector
+        for (size_t j = i; j < i + run; j++) {
+
+            struct bcache_entry *e = &(c->entries[c->order[j].index]);
+
+            if (e->dirty && e->version == c->order[j].version) {
+                e->dirty = 0;
+                c->nb_dirty--;
+            }
+
+        }
+
+        c->stats.writebacks += run;
+        c->stats.write_ios++;
+        i += run;
+
+    }
+
+    c->writing = 0;
+    pthread_cond_broadcast(&(c->written));
+
+    return ret;
+
+}
+
+/**
+ * @brief pick a free entry with the CLOCK algorithm; dirty entries are skipped,
+ *        see bcache_writeback()
+ * @return the entry, not hashed; NULL if every entry is dirty
+ */
+static struct bcache_entry *bcache_evict(struct bcache *c) {
+
+    // two rounds: the first may only clear reference bits
+    for (size_t step = 0; step < 2 * c->capacity; step++) {
+
+        struct bcache_entry *e = &(c->entries[c->hand]);
+        c->hand = (c->hand + 1) % c->capacity;
+
+        if (!e->valid)
+            return e;
+
+        if (e->referenced) {
+            e->referenced = 0;
+            continue;
+        }
+
+        if (e->dirty)
+            continue;
+
+        bcache_unhash(c, e);
+        c->stats.evictions++;
+
+        return e;
+
+    }
+
+    return NULL;
+
+}
+
+/**
+ * @brief store a sector in a newly allocated entry
+ * @return the entry; NULL if no entry can be freed without a write-back
+ */
+static struct bcache_entry *bcache_insert(struct bcache *c, uint32_t sector, const void *data) {
+
+    struct bcache_entry *e = bcache_evict(c);
+
+    if (e == NULL)
+        return NULL;
+
+    uint32_t bucket = bcache_bucket(c, sector);
+
+    memcpy(e->data, data, SECTOR_SIZE);
+    e->sector = sector;
+    e->valid = 1;
+    e->dirty = 0;
+    e->referenced = 1;
+    e->next = c->buckets[bucket];
+    c->buckets[bucket] = (int32_t) (e - c->entries);
+
+    return e;
+
+}
+
+/**
+ * @brief cache the sectors of a run read from the device while the lock was
+ *        released, unless cached meanwhile; none is if a sector was written
+ *        meanwhile (the copy read may then be older than the device)
+ * @param epoch write_epoch when the lock was released
+ */
+static void bcache_insert_run(struct bcache *c, uint64_t epoch, uint32_t sector, uint32_t count,
+                              const uint8_t *data) {
+
+    if (c->write_epoch != epoch)
+        return;
+
+    for (uint32_t j = 0; j < count; j++) {
+
+        if (bcache_lookup(c, sector + j) != NULL)
+            continue;
+
+        // every entry dirty: the sectors are only not cached
+        if (bcache_insert(c, sector + j, data + (size_t) j * SECTOR_SIZE) == NULL)
+            return;
+
+    }
+
+}
+
+/**
+ * @brief bcache_read() with the lock of c held, released while reading the device
+ */
+static int bcache_read_locked(struct bcache *c, uint32_t sector, uint32_t count, void *data) {
+
+    uint8_t *dst = data;
+
+    for (uint32_t i = 0; i < count; ) {
+
+        struct bcache_entry *e = bcache_lookup(c, sector + i);
+
+        if (e != NULL) {
+
+            memcpy(dst + (size_t) i * SECTOR_SIZE, e->data, SECTOR_SIZE);
+            e->referenced = 1;
+            c->stats.hits++;
+            i++;
+            continue;
+
+        }
+
+        // fetch the whole run of missing sectors at once, straight into data
+        uint32_t run = 1;
+
+        while (i + run < count && bcache_lookup(c, sector + i + run) == NULL)
+            run++;
+
+        c->stats.misses += run;
+
+        const uint64_t epoch = c->write_epoch;
+
+        pthread_mutex_unlock(&(c->lock));
+        int readCheck = blockdev_read(c->dev, sector + i, run, dst + (size_t) i * SECTOR_SIZE);
+        pthread_mutex_lock(&(c->lock));
+
+        if (readCheck != ERR_NONE)
+            return readCheck;
+
+        bcache_insert_run(c, epoch, sector + i, run, dst + (size_t) i * SECTOR_SIZE);
+
+        i += run;
+
+    }
+
+    return ERR_NONE;
+
+}
+
+int bcache_read(struct bcache *c, uint32_t sector, uint32_t count, void *data) {
+
+    M_REQUIRE_NON_NULL(c);
+    M_REQUIRE_NON_NULL(data);
+
+    pthread_mutex_lock(&(c->lock));
+    int ret = bcache_read_locked(c, sector, count, data);
+    pthread_mutex_unlock(&(c->lock));
+
+    return ret;
+
+}
+
+/**
+ * @brief wait for one prefetch run submitted to io and record it in the I/O
+ *        statistics of the device
+ * @param done the tag of the run, i.e. its index in missing (OUT)
+ */
+static int bcache_prefetch_complete(struct bcache *c, struct ioengine *io, const uint32_t *missing,
+                                    const uint32_t *runLength, const uint64_t *submitted, uint64_t *done) {
+
+    int waitCheck = ioengine_wait(io, done);
+
+    if (waitCheck != ERR_NONE)
+        return waitCheck;
+
+    if (c->dev->stats != NULL)
+        iostats_record(c->dev->stats, IOSTATS_READ, missing[*done], runLength[*done], iostats_now() - submitted[*done]);
+
+    return ERR_NONE;
+
+}
+
+/**
+ * @brief read the runs of missing sectors into buffer, without the lock of c
+ *        (but with its io_lock, if io is used)
+ * @param runLength the length of each run, at the index of its first sector (OUT)
+ * @param ok 1 at the index of the first sector of each run read (OUT)
+ * @return 0 on success; <0 on error (the first one)
+ */
+static int bcache_prefetch_read(struct bcache *c, struct ioengine *io, const uint32_t *missing, size_t nbMissing,
+                                uint32_t *runLength, uint8_t *ok, uint64_t *submitted, uint8_t *buffer) {
+
+    int ret = ERR_NONE;
+    uint64_t done = 0;
+
+    for (size_t i = 0; i < nbMissing; ) {
+
+        uint32_t run = (uint32_t) sector_run_length(missing + i, nbMissing - i);
+
+        runLength[i] = run;
+
+        if (io == NULL) {
+
+            int readCheck = blockdev_read(c->dev, missing[i], run, buffer + i * SECTOR_SIZE);
+
+            if (readCheck == ERR_NONE)
+                ok[i] = 1;
+            else if (ret == ERR_NONE)
+                ret = readCheck;
+
+            i += run;
+            continue;
+
+        }
+
+        // make room in the engine by completing the oldest reads
+        while (ioengine_pending(io) >= ioengine_depth(io)) {
+
+            int waitCheck = bcache_prefetch_complete(c, io, missing, runLength, submitted, &done);
+
+            if (waitCheck == ERR_NONE)
+                ok[done] = 1;
+            else if (ret == ERR_NONE)
+                ret = waitCheck;
+
+        }
+
+        submitted[i] = iostats_now();
+        int submitCheck = ioengine_submit_read(io, missing[i], run, buffer + i * SECTOR_SIZE, i);
+
+        if (submitCheck != ERR_NONE && ret == ERR_NONE)
+            ret = submitCheck;
+
+        i += run;
+
+    }
+
+    while (io != NULL && ioengine_pending(io) > 0) {
+
+        int waitCheck = bcache_prefetch_complete(c, io, missing, runLength, submitted, &done);
+
+        if (waitCheck == ERR_NONE)
+            ok[done] = 1;
+        else if (ret == ERR_NONE)
+            ret = waitCheck;
+
+    }
+
+    return ret;
+
+}
+
+/**
+ * @brief bcache_prefetch() with the lock of c held, released while reading the device
+ */
+static int bcache_prefetch_locked(struct bcache *c, struct ioengine *io, const uint32_t *sectors, size_t count) {
+
+    count = (count < c->capacity) ? count : c->capacity;
+
+    if (count == 0)
+        return ERR_NONE;
+
+    uint32_t *missing = malloc(count * sizeof(uint32_t));
+    uint32_t *runLength = malloc(count * sizeof(uint32_t));
+    uint8_t *ok = calloc(count, sizeof(uint8_t));
+    uint64_t *submitted = malloc(count * sizeof(uint64_t));
+    uint8_t *buffer = malloc(count * SECTOR_SIZE);
+
+    if (missing == NULL || runLength == NULL || ok == NULL || submitted == NULL || buffer == NULL) {
+        free(missing);
+        free(runLength);
+        free(ok);
+        free(submitted);
+        free(buffer);
+        return ERR_NOMEM;
+    }
+
+    size_t nbMissing = 0;
+
+    for (size_t i = 0; i < count; i++) {
+
+        if (bcache_lookup(c, sectors[i]) == NULL && (nbMissing == 0 || missing[nbMissing - 1] != sectors[i]))
+            missing[nbMissing++] = sectors[i];
+
+    }
+
+    c->stats.misses += nbMissing;
+
+    const uint64_t epoch = c->write_epoch;
+
+    pthread_mutex_unlock(&(c->lock));
+
+    if (io != NULL)
+        pthread_mutex_lock(&(c->io_lock));
+
+    int ret = bcache_prefetch_read(c, io, missing, nbMissing, runLength, ok, submitted, buffer);
+
+    if (io != NULL)
+        pthread_mutex_unlock(&(c->io_lock));
+
+    pthread_mutex_lock(&(c->lock));
+
+    for (size_t i = 0; i < nbMissing; i += runLength[i]) {
+
+        if (ok[i])
+            bcache_insert_run(c, epoch, missing[i], runLength[i], buffer + i * SECTOR_SIZE);
+
+    }
+
+    free(missing);
+    free(runLength);
+    free(ok);
+    free(submitted);
+    free(buffer);
+
+    return ret;
+
+}
+
+int bcache_prefetch(struct bcache *c, struct ioengine *io, const uint32_t *sectors, size_t count) {
+
+    M_REQUIRE_NON_NULL(c);
+    M_REQUIRE_NON_NULL(sectors);
+
+    pthread_mutex_lock(&(c->lock));
+    int ret = bcache_prefetch_locked(c, io, sectors, count);
+    pthread_mutex_unlock(&(c->lock));
+
+    return ret;
+
+}
+
+/**
+ * @brief bcache_write() with the lock of c held, released while writing back
+ */
+static int bcache_write_locked(struct bcache *c, uint32_t sector, const void *data) {
+
+    if (!c->dev->writable)
+        return ERR_READ_ONLY;
+
+    struct bcache_entry *e = bcache_lookup(c, sector);
+
+    // every entry dirty: make room, then look again, since the lock was released
+    while (e == NULL) {
+
+        e = bcache_insert(c, sector, data);
+
+        if (e != NULL)
+            break;
+
+        int writebackCheck = bcache_writeback(c);
+
+        if (writebackCheck != ERR_NONE)
+            return writebackCheck;
+
+        e = bcache_lookup(c, sector);
+
+    }
+
+    memcpy(e->data, data, SECTOR_SIZE);
+    e->referenced = 1;
+    e->version++;
+    c->write_epoch++;
+
+    if (!e->dirty) {
+        e->dirty = 1;
+        c->nb_dirty++;
+    }
+
+    if (c->nb_dirty >= c->dirty_limit)
+        return bcache_writeback(c);
+
+    return ERR_NONE;
+
+}
+
+int bcache_write(struct bcache *c, uint32_t sector, const void *data) {
+
+    M_REQUIRE_NON_NULL(c);
+    M_REQUIRE_NON_NULL(data);
+
+    pthread_mutex_lock(&(c->lock));
+    int ret = bcache_write_locked(c, sector, data);
+    pthread_mutex_unlock(&(c->lock));
+
+    return ret;
+
+}
+
+int bcache_flush(struct bcache *c) {
+
+    M_REQUIRE_NON_NULL(c);
+
+    pthread_mutex_lock(&(c->lock));
+    int ret = bcache_writeback(c);
+    pthread_mutex_unlock(&(c->lock));
+
+    return ret;
+
+}
+
+void bcache_print_stats(const struct bcache_stats *s) {
+
+    if (s == NULL || s->capacity == 0)
+        return;
+
+    uint64_t lookups = s->hits + s->misses;
+
+    pps_printf("**********SECTOR CACHE START**********\n");
+    pps_printf("%-20s: %zu\n", "capacity", s->capacity);
+    pps_printf("%-20s: %" PRIu64 "\n", "hits", s->hits);
+    pps_printf("%-20s: %" PRIu64 "\n", "misses", s->misses);
+    pps_printf("%-20s: %.1f%%\n", "hit ratio", lookups ? 100.0 * (double) s->hits / (double) lookups : 0.0);
+    pps_printf("%-20s: %" PRIu64 "\n", "evictions", s->evictions);
+    pps_printf("%-20s: %" PRIu64 "\n", "writebacks", s->writebacks);
+    pps_printf("%-20s: %" PRIu64 "\n", "write I/Os", s->write_ios);
+    pps_printf("**********SECTOR CACHE END************\n");
+
+}
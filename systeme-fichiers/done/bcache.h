@@ -0,0 +1,155 @@
+#pragma once
+
+/**
+ * @file bcache.h
+ * @brief sector buffer cache of a mounted filesystem
+ *
+ * A bounded set of sector buffers, indexed by a hash table and recycled
+ * with the CLOCK (second chance) algorithm. Writes are kept in the cache
+ * (write-back). Dirty sectors are written back together, sorted by sector
+ * number and merged into one device write per contiguous run, when a dirty
+ * buffer has to be evicted, when more than dirty_limit buffers are dirty, or
+ * on bcache_flush().
+ * Only the file-based backends (stdio, pread, direct) get a cache: a mapped
+ * or RAM image already is in memory, where fs_sector_map() reads it in place,
+ * so a cached copy of its sectors would only add a copy per read. u6fs reads
+ * through pread and the cache unless U6FS_BACKEND=mmap asks otherwise.
+ * Every function but bcache_free() and bcache_print_stats() may be called
+ * from several threads. They serialize on the lock of the cache to look up
+ * and copy sectors (never handing out pointers to its buffers), but release
+ * it around device I/O, so that the reads of several threads overlap:
+ * - a read miss is read without the lock, and only cached if no sector was
+ *   written meanwhile (write_epoch), so that it cannot hide a newer copy;
+ * - a dirty buffer is never evicted, so a sector missing from the cache is
+ *   current on disk;
+ * - one write-back runs at a time (writing): it copies the dirty sectors to
+ *   staging, writes them without the lock, and marks clean those that were
+ *   not written again meanwhile (version);
+ * - the prefetches share the ioengine, under their own lock (io_lock).
+ */
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <pthread.h>
+#include "blockdev.h"
+#include "ioengine.h"
+#include "unixv6fs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BCACHE_DEFAULT_SIZE 256 // sectors, i.e. 128 KiB
+#define BCACHE_DIRTY_RATIO 2    // write back once capacity/BCACHE_DIRTY_RATIO buffers are dirty
+
+struct bcache_entry {
+    uint32_t sector;            // the sector held by this buffer
+    uint8_t valid;              // 1 if the buffer holds a sector
+    uint8_t dirty;              // 1 if the buffer must be written back
+    uint8_t referenced;         // CLOCK reference bit
+    int32_t next;               // next entry of the same hash bucket, -1 at the end
+    uint32_t version;           // incremented by each bcache_write() of the sector
+    uint8_t data[SECTOR_SIZE];
+};
+
+struct bcache_dirty {
+    uint32_t sector;            // sector of a dirty entry
+    int32_t index;              // the entry
+    uint32_t version;           // its version when it was copied to staging
+};
+
+struct bcache_stats {
+    size_t capacity;            // number of entries of the cache
+    uint64_t hits;              // lookups served from the cache
+    uint64_t misses;            // lookups that had to read the device
+    uint64_t evictions;         // valid buffers recycled
+    uint64_t writebacks;        // dirty sectors written to the device
+    uint64_t write_ios;         // device writes issued for them
+};
+
+struct bcache {
+    struct blockdev *dev;       // the device cached
+    size_t capacity;            // number of entries
+    size_t hand;                // CLOCK hand
+    uint32_t bucket_mask;       // number of hash buckets - 1 (power of two)
+    int32_t *buckets;           // first entry of each bucket, -1 if empty
+    struct bcache_entry *entries;
+    size_t nb_dirty;            // number of dirty entries
+    size_t dirty_limit;         // nb_dirty that triggers a write-back
+    struct bcache_dirty *order; // scratch of the write-back: dirty entries sorted by sector
+    uint8_t *staging;           // scratch of the write-back: their data, in the same order
+    uint64_t write_epoch;       // number of bcache_write() calls
+    int writing;                // 1 while a write-back owns order and staging
+    pthread_cond_t written;     // signaled when writing drops to 0
+    pthread_mutex_t lock;       // protects everything above and the counters
+    pthread_mutex_t io_lock;    // serializes the prefetches, which share an ioengine
+    struct bcache_stats stats;  // the counters
+};
+
+/**
+ * @brief allocate a cache of capacity sectors in front of dev
+ * @param dev the block device (must outlive the cache)
+ * @param capacity the number of sectors the cache can hold (>0)
+ * @return the new cache; NULL on failure
+ */
+struct bcache *bcache_alloc(struct blockdev *dev, size_t capacity);
+
+/**
+ * @brief release a cache; dirty sectors are NOT written back (see bcache_flush())
+ * @param c the cache (may be NULL)
+ */
+void bcache_free(struct bcache *c);
+
+/**
+ * @brief read a run of contiguous sectors through the cache; missing sectors
+ *        are fetched with one device read per run of misses
+ * @param c the cache
+ * @param sector the first sector of the run
+ * @param count the number of sectors in the run
+ * @param data a pointer to count*512 bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int bcache_read(struct bcache *c, uint32_t sector, uint32_t count, void *data);
+
+/**
+ * @brief bring a list of sectors into the cache before they are read. The
+ *        sectors not cached yet are grouped in contiguous runs, which are all
+ *        submitted to io (up to its depth) before waiting for any of them.
+ *        At most capacity sectors are prefetched.
+ * @param c the cache
+ * @param io the engine reading from the device of c; NULL to read the runs one
+ *        after the other
+ * @param sectors the sectors to prefetch (IN)
+ * @param count the number of entries in sectors
+ * @return 0 on success; <0 on error
+ */
+int bcache_prefetch(struct bcache *c, struct ioengine *io, const uint32_t *sectors, size_t count);
+
+/**
+ * @brief write one sector into the cache; it reaches the device with the
+ *        next write-back of the dirty sectors
+ * @param c the cache
+ * @param sector the sector
+ * @param data a pointer to 512 bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+int bcache_write(struct bcache *c, uint32_t sector, const void *data);
+
+/**
+ * @brief write every dirty sector back to the device, in sector order and
+ *        with one write per contiguous run
+ * @param c the cache
+ * @return 0 on success; <0 on error
+ */
+int bcache_flush(struct bcache *c);
+
+/**
+ * @brief print the hit/miss counters of a cache to stdout, e.g. to size it
+ * @param s the counters, those of a cache or a copy of them; nothing is
+ *        printed if they belong to no cache (zero capacity)
+ */
+void bcache_print_stats(const struct bcache_stats *s);
+
+#ifdef __cplusplus
+}
+#endif
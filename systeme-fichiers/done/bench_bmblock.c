@@ -0,0 +1,221 @@
+/**
+ * @file bench_bmblock.c
+ * @brief microbenchmark of the bmblock_array operations
+ *
+ * Measures the throughput of bm_alloc(), bm_set(), bm_clear(), bm_get() and
+ * bm_find_next() on bitmaps from a few hundred to a few million values,
+ * filled to 0%, 50%, 90% and 99.9%, either from the first value on
+ * (sequential) or at random. The values are drawn from a fixed seed, so
+ * that two runs, e.g. before and after an allocator change, are comparable.
+ *
+ * usage: bench_bmblock [operations per measure]
+ * The default build has the address sanitizer: for meaningful numbers, build with
+ *     make clean && make CPPFLAGS= LDFLAGS= LDLIBS=-lpthread CFLAGS=-O2 bench_bmblock
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "bmblock.h"
+#include "iostats.h"
+#include "error.h"
+#include "util.h"
+
+#define BENCH_DEFAULT_OPS (UINT64_C(1) << 20) // operations per measure
+#define BENCH_MIN 1                           // first value of the bitmaps, as for the inodes
+
+static const uint64_t bench_sizes[] = { 256, 4096, 65536, UINT64_C(1) << 20, UINT64_C(1) << 22 };
+
+// fill ratios, in thousandths
+static const uint64_t bench_fills[] = { 0, 500, 900, 999 };
+
+enum bench_pattern {
+    BENCH_SEQUENTIAL,           // the first values are set
+    BENCH_RANDOM,               // values drawn at random are set
+    BENCH_NB_PATTERNS
+};
+
+static const char *const bench_pattern_names[BENCH_NB_PATTERNS] = { "seq", "random" };
+
+static uint64_t bench_seed = UINT64_C(0x9E3779B97F4A7C15);
+
+// results that must be computed, but are not printed
+static volatile uint64_t bench_sink;
+
+/**
+ * @brief the next pseudo-random number (xorshift64)
+ */
+static uint64_t bench_random(void)
+{
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+    return bench_seed;
+}
+
+/**
+ * @brief millions of operations per second
+ */
+static double bench_mops(uint64_t ops, uint64_t ns)
+{
+    return (ns == 0) ? 0.0 : (double) ops * 1e3 / (double) ns;
+}
+
+/**
+ * @brief shuffle the values [BENCH_MIN, BENCH_MIN + size) into values: the
+ *        first ones are those a fill sets, the others are free
+ */
+static void bench_order(uint64_t *values, uint64_t size, enum bench_pattern pattern)
+{
+    for (uint64_t i = 0; i < size; ++i) {
+        values[i] = BENCH_MIN + i;
+    }
+
+    if (pattern == BENCH_RANDOM) {
+        for (uint64_t i = size - 1; i > 0; --i) {
+            const uint64_t j = bench_random() % (i + 1);
+            const uint64_t tmp = values[i];
+            values[i] = values[j];
+            values[j] = tmp;
+        }
+    }
+}
+
+/**
+ * @brief time nb bm_alloc() (and free) of a bitmap of size values
+ * @return the number of nanoseconds
+ */
+static uint64_t bench_alloc(uint64_t size, uint64_t nb)
+{
+    const uint64_t start = iostats_now();
+
+    for (uint64_t i = 0; i < nb; ++i) {
+        struct bmblock_array *bm = bm_alloc(BENCH_MIN, BENCH_MIN + size - 1);
+        if (bm == NULL) {
+            return 0;
+        }
+        bm_free(bm);
+    }
+
+    return iostats_now() - start;
+}
+
+/**
+ * @brief measure the operations on one bitmap and print a line
+ * @param values the order of the values, see bench_order()
+ * @param used how many of them the fill sets
+ * @param ops operations per measure
+ * @return 0 on success, <0 on error
+ */
+static int bench_bitmap(uint64_t size, const uint64_t *values, uint64_t used, uint64_t ops,
+                        const char *pattern, uint64_t fill)
+{
+    struct bmblock_array *bm = bm_alloc(BENCH_MIN, BENCH_MIN + size - 1);
+    if (bm == NULL) {
+        return ERR_NOMEM;
+    }
+
+    for (uint64_t i = 0; i < used; ++i) {
+        bm_set(bm, values[i]);
+    }
+
+    // bm_get(): random values, summed into bench_sink so that the loop is not optimized away
+    uint64_t start = iostats_now();
+    for (uint64_t i = 0; i < ops; ++i) {
+        bench_sink += (uint64_t) bm_get(bm, BENCH_MIN + bench_random() % size);
+    }
+    const uint64_t getNs = iostats_now() - start;
+
+    // bm_set() then bm_clear(): free values, cycled through if there are fewer than ops
+    const uint64_t nbFree = size - used;
+    start = iostats_now();
+    for (uint64_t i = 0; i < ops; ++i) {
+        bm_set(bm, values[used + i % nbFree]);
+    }
+    const uint64_t setNs = iostats_now() - start;
+
+    start = iostats_now();
+    for (uint64_t i = 0; i < ops; ++i) {
+        bm_clear(bm, values[used + i % nbFree]);
+    }
+    const uint64_t clearNs = iostats_now() - start;
+
+    // bm_find_next(): the allocation path, each value found is then set
+    const uint64_t nbFind = MIN(ops, nbFree);
+    int ret = ERR_NONE;
+    start = iostats_now();
+    for (uint64_t i = 0; i < nbFind && ret == ERR_NONE; ++i) {
+        const int x = bm_find_next(bm);
+        if (x < 0) {
+            ret = x;
+        } else {
+            bm_set(bm, (uint64_t) x);
+        }
+    }
+    const uint64_t findNs = iostats_now() - start;
+
+    if (ret == ERR_NONE) {
+        pps_printf("%9" PRIu64 " %5.1f%% %-7s %10.2f %10.2f %10.2f %10.2f\n", size, (double) fill / 10.0, pattern,
+                   bench_mops(ops, setNs), bench_mops(ops, clearNs), bench_mops(ops, getNs),
+                   bench_mops(nbFind, findNs));
+    }
+
+    bm_free(bm);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    const uint64_t ops = (argc > 1) ? strtoull(argv[1], NULL, 10) : BENCH_DEFAULT_OPS;
+
+    if (ops == 0) {
+        fprintf(stderr, "usage: %s [operations per measure]\n", argv[0]);
+        return 1;
+    }
+
+    pps_printf("%9s %10s\n", "size", "bm_alloc");
+    for (size_t s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); ++s) {
+        // as many bits allocated as ops bm_set()
+        const uint64_t nb = MAX(ops / bench_sizes[s], UINT64_C(16));
+        const uint64_t ns = bench_alloc(bench_sizes[s], nb);
+
+        if (ns == 0) {
+            fprintf(stderr, "bm_alloc() failed\n");
+            return 1;
+        }
+        pps_printf("%9" PRIu64 " %7.0f ns\n", bench_sizes[s], (double) ns / (double) nb);
+    }
+
+    pps_printf("\nthroughput in millions of operations per second\n");
+    pps_printf("%9s %6s %-7s %10s %10s %10s %10s\n", "size", "fill", "pattern", "bm_set", "bm_clear", "bm_get",
+               "find_next");
+
+    for (size_t s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); ++s) {
+        const uint64_t size = bench_sizes[s];
+        uint64_t *values = malloc(size * sizeof(uint64_t));
+        if (values == NULL) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+
+        for (int p = 0; p < BENCH_NB_PATTERNS; ++p) {
+            bench_order(values, size, (enum bench_pattern) p);
+
+            for (size_t f = 0; f < sizeof(bench_fills) / sizeof(bench_fills[0]); ++f) {
+                // at least one free value
+                const uint64_t used = MIN(size * bench_fills[f] / 1000, size - 1);
+                const int ret = bench_bitmap(size, values, used, ops, bench_pattern_names[p], bench_fills[f]);
+
+                if (ret != ERR_NONE) {
+                    fprintf(stderr, "bench of %" PRIu64 " values failed: %s\n", size, ERR_MESSAGES[ret - ERR_FIRST]);
+                    free(values);
+                    return 1;
+                }
+            }
+        }
+
+        free(values);
+    }
+
+    return 0;
+}
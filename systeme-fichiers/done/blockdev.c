@@ -0,0 +1,794 @@
+/**
+ * @file blockdev.c
+ * @brief block-device backends: stdio, pread/pwrite, mmap, RAM image and O_DIRECT
+ */
+
+#define _GNU_SOURCE   // O_DIRECT
+
+#include <string.h>   // memset(), memcpy(), strcmp()
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>    // open()
+#include <unistd.h>   // pread(), pwrite(), close(), ftruncate(), sysconf()
+#include <sys/mman.h> // mmap(), madvise()
+#include <sys/stat.h> // fstat()
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h> // BLKSSZGET, BLKGETSIZE64
+#endif
+#include "blockdev.h"
+#include "sector.h"
+#include "error.h"
+#include "unixv6fs.h"
+#include "util.h"
+
+/*
+ * stdio backend
+ */
+
+static int stdio_read(const struct blockdev *bd, uint32_t sector, uint32_t count, void *data) {
+
+    return sector_read_range(bd->f, sector, count, data);
+
+}
+
+static int stdio_write(struct blockdev *bd, uint32_t sector, uint32_t count, const void *data) {
+
+    return sector_write_range(bd->f, sector, count, data);
+
+}
+
+static int stdio_close(struct blockdev *bd) {
+
+    return (fclose(bd->f) != 0) ? ERR_IO : ERR_NONE;
+
+}
+
+static const struct blockdev_ops stdio_ops = {
+    .name  = "stdio",
+    .read  = stdio_read,
+    .write = stdio_write,
+    .close = stdio_close,
+};
+
+/*
+ * pread/pwrite backend
+ */
+
+static int pread_read(const struct blockdev *bd, uint32_t sector, uint32_t count, void *data) {
+
+    return sector_pread_range(bd->fd, sector, count, data);
+
+}
+
+static int pread_write(struct blockdev *bd, uint32_t sector, uint32_t count, const void *data) {
+
+    return sector_pwrite_range(bd->fd, sector, count, data);
+
+}
+
+static int pread_close(struct blockdev *bd) {
+
+    return (close(bd->fd) != 0) ? ERR_IO : ERR_NONE;
+
+}
+
+static const struct blockdev_ops pread_ops = {
+    .name  = "pread",
+    .read  = pread_read,
+    .write = pread_write,
+    .close = pread_close,
+};
+
+/*
+ * in-memory backends (mmap and RAM): the image is one contiguous buffer
+ */
+
+static int memory_read(const struct blockdev *bd, uint32_t sector, uint32_t count, void *data) {
+
+    const void *src = blockdev_map(bd, sector, count);
+
+    if (src == NULL)
+        return ERR_IO;
+
+    memcpy(data, src, (size_t) count * SECTOR_SIZE);
+
+    return ERR_NONE;
+
+}
+
+static int memory_write(struct blockdev *bd, uint32_t sector, uint32_t count, const void *data) {
+
+    if (blockdev_map(bd, sector, count) == NULL)
+        return ERR_IO;
+
+    memcpy(bd->image + (size_t) sector * SECTOR_SIZE, data, (size_t) count * SECTOR_SIZE);
+
+    return ERR_NONE;
+
+}
+
+static int mmap_close(struct blockdev *bd) {
+
+    int ret = 0;
+
+    if (bd->writable)
+        ret = msync(bd->image, bd->size, MS_SYNC);
+
+    ret |= munmap(bd->image, bd->size);
+
+    return (ret != 0) ? ERR_IO : ERR_NONE;
+
+}
+
+static int ram_close(struct blockdev *bd) {
+
+    free(bd->image);
+
+    return ERR_NONE;
+
+}
+
+static const struct blockdev_ops mmap_ops = {
+    .name  = "mmap",
+    .read  = memory_read,
+    .write = memory_write,
+    .close = mmap_close,
+};
+
+static const struct blockdev_ops ram_ops = {
+    .name  = "ram",
+    .read  = memory_read,
+    .write = memory_write,
+    .close = ram_close,
+};
+
+/*
+ * O_DIRECT backend: every I/O must start, end and land in memory on a
+ * multiple of the logical block size, so sectors go through aligned
+ * bounce buffers taken from a small pool
+ */
+
+#define BLOCKDEV_POOL_SIZE 4               // bounce buffers kept around
+#define BLOCKDEV_POOL_BUFFER (64 * 1024)   // bytes per bounce buffer, the largest single I/O
+#define BLOCKDEV_DEFAULT_ALIGN 4096        // when the logical block size cannot be queried
+
+struct blockdev_pool {
+    pthread_mutex_t lock;
+    size_t nb_free;
+    void *free[BLOCKDEV_POOL_SIZE];
+    pthread_rwlock_t io;    // held exclusively by a write: its read-modify-write of a partial
+                            // block, and the ftruncate() of the last one, must not interleave
+                            // with another write, nor with a read of the same blocks
+};
+
+/**
+ * @brief take a bounce buffer from the pool, allocating one if it is empty
+ */
+static void *pool_get(const struct blockdev *bd) {
+
+    void *buffer = NULL;
+
+    pthread_mutex_lock(&(bd->pool->lock));
+
+    if (bd->pool->nb_free > 0)
+        buffer = bd->pool->free[--bd->pool->nb_free];
+
+    pthread_mutex_unlock(&(bd->pool->lock));
+
+    if (buffer == NULL && posix_memalign(&buffer, bd->align, BLOCKDEV_POOL_BUFFER) != 0)
+        return NULL;
+
+    return buffer;
+
+}
+
+/**
+ * @brief give a bounce buffer back to the pool, freeing it if the pool is full
+ */
+static void pool_put(const struct blockdev *bd, void *buffer) {
+
+    pthread_mutex_lock(&(bd->pool->lock));
+
+    if (bd->pool->nb_free < BLOCKDEV_POOL_SIZE) {
+        bd->pool->free[bd->pool->nb_free++] = buffer;
+        buffer = NULL;
+    }
+
+    pthread_mutex_unlock(&(bd->pool->lock));
+
+    free(buffer);
+
+}
+
+/**
+ * @brief read len aligned bytes at offset; what lies beyond the end of the image reads as zeros
+ * @return 0 on success; <0 on error
+ */
+static int direct_pread(const struct blockdev *bd, uint8_t *buffer, size_t len, off_t offset) {
+
+    while (len > 0) {
+
+        ssize_t nb_read = pread(bd->fd, buffer, len, offset);
+
+        if (nb_read < 0 && errno == EINTR)
+            continue;
+
+        if (nb_read < 0)
+            return ERR_IO;
+
+        if (nb_read == 0) {
+            memset(buffer, 0, len);
+            return ERR_NONE;
+        }
+
+        buffer += nb_read;
+        len -= (size_t) nb_read;
+        offset += nb_read;
+
+    }
+
+    return ERR_NONE;
+
+}
+
+/**
+ * @brief write len aligned bytes at offset
+ * @return 0 on success; <0 on error
+ */
+static int direct_pwrite(struct blockdev *bd, const uint8_t *buffer, size_t len, off_t offset) {
+
+    while (len > 0) {
+
+        ssize_t nb_written = pwrite(bd->fd, buffer, len, offset);
+
+        if (nb_written < 0 && errno == EINTR)
+            continue;
+
+        if (nb_written <= 0)
+            return ERR_IO;
+
+        buffer += nb_written;
+        len -= (size_t) nb_written;
+        offset += nb_written;
+
+    }
+
+    return ERR_NONE;
+
+}
+
+/**
+ * @brief the aligned chunk of at most BLOCKDEV_POOL_BUFFER bytes holding the byte at start
+ */
+static void direct_chunk(const struct blockdev *bd, size_t start, size_t end, size_t *chunkStart, size_t *chunkEnd) {
+
+    *chunkStart = start - start % bd->align;
+    *chunkEnd = end + (bd->align - end % bd->align) % bd->align;
+
+    if (*chunkEnd - *chunkStart > BLOCKDEV_POOL_BUFFER)
+        *chunkEnd = *chunkStart + BLOCKDEV_POOL_BUFFER;
+
+}
+
+static int direct_read(const struct blockdev *bd, uint32_t sector, uint32_t count, void *data) {
+
+    uint8_t *dst = data;
+    size_t start = (size_t) sector * SECTOR_SIZE;
+    size_t end = start + (size_t) count * SECTOR_SIZE;
+
+    if (end > bd->size)
+        return ERR_IO;
+
+    int ret = ERR_NONE;
+
+    pthread_rwlock_rdlock(&(bd->pool->io));
+
+    // already aligned: straight into the caller's memory
+    if ((uintptr_t) data % bd->align == 0 && start % bd->align == 0 && end % bd->align == 0) {
+
+        ret = direct_pread(bd, dst, end - start, (off_t) start);
+
+        pthread_rwlock_unlock(&(bd->pool->io));
+
+        return ret;
+
+    }
+
+    uint8_t *buffer = pool_get(bd);
+
+    if (buffer == NULL) {
+
+        pthread_rwlock_unlock(&(bd->pool->io));
+
+        return ERR_NOMEM;
+
+    }
+
+    while (start < end && ret == ERR_NONE) {
+
+        size_t chunkStart, chunkEnd;
+        direct_chunk(bd, start, end, &chunkStart, &chunkEnd);
+
+        ret = direct_pread(bd, buffer, chunkEnd - chunkStart, (off_t) chunkStart);
+
+        size_t len = MIN(end, chunkEnd) - start;
+        memcpy(dst, buffer + (start - chunkStart), len);
+
+        dst += len;
+        start += len;
+
+    }
+
+    pthread_rwlock_unlock(&(bd->pool->io));
+
+    pool_put(bd, buffer);
+
+    return ret;
+
+}
+
+static int direct_write(struct blockdev *bd, uint32_t sector, uint32_t count, const void *data) {
+
+    const uint8_t *src = data;
+    size_t start = (size_t) sector * SECTOR_SIZE;
+    size_t end = start + (size_t) count * SECTOR_SIZE;
+
+    if (end > bd->size)
+        return ERR_IO;
+
+    uint8_t *buffer = pool_get(bd);
+
+    if (buffer == NULL)
+        return ERR_NOMEM;
+
+    int ret = ERR_NONE;
+
+    pthread_rwlock_wrlock(&(bd->pool->io));
+
+    while (start < end && ret == ERR_NONE) {
+
+        size_t chunkStart, chunkEnd;
+        direct_chunk(bd, start, end, &chunkStart, &chunkEnd);
+
+        size_t len = MIN(end, chunkEnd) - start;
+
+        // a partially written block keeps the rest of its sectors
+        if (chunkStart < start || chunkStart + len < chunkEnd)
+            ret = direct_pread(bd, buffer, chunkEnd - chunkStart, (off_t) chunkStart);
+
+        if (ret != ERR_NONE)
+            break;
+
+        memcpy(buffer + (start - chunkStart), src, len);
+
+        ret = direct_pwrite(bd, buffer, chunkEnd - chunkStart, (off_t) chunkStart);
+
+        // the last block of an image that is not a multiple of it must not grow the image
+        if (ret == ERR_NONE && chunkEnd > bd->size && ftruncate(bd->fd, (off_t) bd->size) != 0)
+            ret = ERR_IO;
+
+        src += len;
+        start += len;
+
+    }
+
+    pthread_rwlock_unlock(&(bd->pool->io));
+
+    pool_put(bd, buffer);
+
+    return ret;
+
+}
+
+static int direct_close(struct blockdev *bd) {
+
+    for (size_t i = 0; i < bd->pool->nb_free; i++)
+        free(bd->pool->free[i]);
+
+    pthread_rwlock_destroy(&(bd->pool->io));
+    pthread_mutex_destroy(&(bd->pool->lock));
+    free(bd->pool);
+
+    return (close(bd->fd) != 0) ? ERR_IO : ERR_NONE;
+
+}
+
+static const struct blockdev_ops direct_ops = {
+    .name  = "direct",
+    .read  = direct_read,
+    .write = direct_write,
+    .close = direct_close,
+};
+
+/**
+ * @brief query the size and the logical block size of the image opened as fd
+ *        (with O_DIRECT) and set up the bounce buffer pool
+ */
+static int blockdev_direct_setup(struct blockdev *bd, int fd) {
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0)
+        return ERR_IO;
+
+    bd->size = (size_t) st.st_size;
+    bd->align = BLOCKDEV_DEFAULT_ALIGN;
+
+#ifdef __linux__
+    if (S_ISBLK(st.st_mode)) {
+
+        int blockSize = 0;
+        uint64_t size = 0;
+
+        if (ioctl(fd, BLKSSZGET, &blockSize) != 0 || ioctl(fd, BLKGETSIZE64, &size) != 0)
+            return ERR_IO;
+
+        bd->align = (size_t) blockSize;
+        bd->size = (size_t) size;
+
+    }
+#endif
+
+    // a power of two that a bounce buffer can hold
+    if (bd->align < SECTOR_SIZE || bd->align > BLOCKDEV_POOL_BUFFER || (bd->align & (bd->align - 1)) != 0)
+        return ERR_IO;
+
+    if (bd->size < SECTOR_SIZE)
+        return ERR_IO;
+
+    bd->pool = calloc(1, sizeof(struct blockdev_pool));
+
+    if (bd->pool == NULL)
+        return ERR_NOMEM;
+
+    if (pthread_mutex_init(&(bd->pool->lock), NULL) != 0) {
+
+        free(bd->pool);
+        bd->pool = NULL;
+
+        return ERR_IO;
+
+    }
+
+    if (pthread_rwlock_init(&(bd->pool->io), NULL) != 0) {
+
+        pthread_mutex_destroy(&(bd->pool->lock));
+        free(bd->pool);
+        bd->pool = NULL;
+
+        return ERR_IO;
+
+    }
+
+    bd->fd = fd;
+
+    return ERR_NONE;
+
+}
+
+static const struct blockdev_ops *const blockdev_types[BLOCKDEV_NB_TYPES] = {
+    [BLOCKDEV_STDIO] = &stdio_ops,
+    [BLOCKDEV_PREAD] = &pread_ops,
+    [BLOCKDEV_MMAP]  = &mmap_ops,
+    [BLOCKDEV_RAM]   = &ram_ops,
+    [BLOCKDEV_DIRECT] = &direct_ops,
+};
+
+/**
+ * @brief map (mmap) or load (RAM) the image opened as fd
+ */
+static int blockdev_load_image(struct blockdev *bd, int fd, enum blockdev_type type) {
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || st.st_size < SECTOR_SIZE)
+        return ERR_IO;
+
+    bd->size = (size_t) st.st_size;
+
+    if (type == BLOCKDEV_MMAP) {
+
+        int prot = PROT_READ | (bd->writable ? PROT_WRITE : 0);
+        void *map = mmap(NULL, bd->size, prot, bd->writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+
+        if (map == MAP_FAILED)
+            return ERR_IO;
+
+        bd->image = map;
+
+        return ERR_NONE;
+
+    }
+
+    bd->image = malloc(bd->size);
+
+    if (bd->image == NULL)
+        return ERR_NOMEM;
+
+    bd->fd = fd;
+    int readCheck = pread_read(bd, 0, (uint32_t) (bd->size / SECTOR_SIZE), bd->image);
+    bd->fd = -1;
+
+    if (readCheck != ERR_NONE) {
+
+        free(bd->image);
+        bd->image = NULL;
+
+        return readCheck;
+
+    }
+
+    return ERR_NONE;
+
+}
+
+int blockdev_open(struct blockdev *bd, const char *filename, enum blockdev_type type, int writable) {
+
+    M_REQUIRE_NON_NULL(bd);
+    M_REQUIRE_NON_NULL(filename);
+
+    if (type >= BLOCKDEV_NB_TYPES)
+        return ERR_BAD_PARAMETER;
+
+    memset(bd, 0, sizeof(*bd));
+    bd->fd = -1;
+    bd->writable = writable;
+
+    if (type == BLOCKDEV_STDIO) {
+
+        bd->f = fopen(filename, writable ? "r+" : "r");
+
+        if (bd->f == NULL)
+            return ERR_IO;
+
+        bd->ops = blockdev_types[type];
+
+        return ERR_NONE;
+
+    }
+
+    int flags = writable ? O_RDWR : O_RDONLY;
+
+#ifdef O_DIRECT
+    if (type == BLOCKDEV_DIRECT)
+        flags |= O_DIRECT;
+#endif
+
+    // O_DIRECT is refused by filesystems that do not support it (e.g. tmpfs)
+    int fd = open(filename, flags);
+
+    if (fd < 0)
+        return ERR_IO;
+
+    if (type == BLOCKDEV_DIRECT) {
+
+        int setupCheck = blockdev_direct_setup(bd, fd);
+
+        if (setupCheck != ERR_NONE) {
+
+            close(fd);
+
+            return setupCheck;
+
+        }
+
+        bd->ops = blockdev_types[type];
+
+        return ERR_NONE;
+
+    }
+
+    if (type == BLOCKDEV_PREAD) {
+
+        bd->fd = fd;
+        bd->ops = blockdev_types[type];
+
+        return ERR_NONE;
+
+    }
+
+    int loadCheck = blockdev_load_image(bd, fd, type);
+
+    // a mapping stays valid once its descriptor is closed
+    close(fd);
+
+    if (loadCheck != ERR_NONE)
+        return loadCheck;
+
+    bd->ops = blockdev_types[type];
+
+    return ERR_NONE;
+
+}
+
+int blockdev_close(struct blockdev *bd) {
+
+    M_REQUIRE_NON_NULL(bd);
+
+    if (bd->ops == NULL)
+        return ERR_IO;
+
+    int ret = bd->ops->close(bd);
+
+    memset(bd, 0, sizeof(*bd));
+    bd->fd = -1;
+
+    return ret;
+
+}
+
+int blockdev_read(const struct blockdev *bd, uint32_t sector, uint32_t count, void *data) {
+
+    M_REQUIRE_NON_NULL(bd);
+    M_REQUIRE_NON_NULL(data);
+
+    if (bd->ops == NULL)
+        return ERR_IO;
+
+    if (count == 0)
+        return ERR_NONE;
+
+    if (bd->stats == NULL)
+        return bd->ops->read(bd, sector, count, data);
+
+    uint64_t start = iostats_now();
+    int ret = bd->ops->read(bd, sector, count, data);
+
+    iostats_record(bd->stats, IOSTATS_READ, sector, count, iostats_now() - start);
+
+    return ret;
+
+}
+
+int blockdev_write(struct blockdev *bd, uint32_t sector, uint32_t count, const void *data) {
+
+    M_REQUIRE_NON_NULL(bd);
+    M_REQUIRE_NON_NULL(data);
+
+    if (bd->ops == NULL)
+        return ERR_IO;
+
+    if (!bd->writable)
+        return ERR_READ_ONLY;
+
+    if (count == 0)
+        return ERR_NONE;
+
+    if (bd->stats == NULL)
+        return bd->ops->write(bd, sector, count, data);
+
+    uint64_t start = iostats_now();
+    int ret = bd->ops->write(bd, sector, count, data);
+
+    iostats_record(bd->stats, IOSTATS_WRITE, sector, count, iostats_now() - start);
+
+    return ret;
+
+}
+
+int blockdev_readv(const struct blockdev *bd, const uint32_t *sectors, size_t count, void *data) {
+
+    M_REQUIRE_NON_NULL(bd);
+    M_REQUIRE_NON_NULL(sectors);
+    M_REQUIRE_NON_NULL(data);
+
+    uint8_t *dst = data;
+
+    for (size_t i = 0; i < count; ) {
+
+        size_t run = sector_run_length(sectors + i, count - i);
+
+        int readCheck = blockdev_read(bd, sectors[i], (uint32_t) run, dst + i * SECTOR_SIZE);
+
+        if (readCheck != ERR_NONE)
+            return readCheck;
+
+        i += run;
+
+    }
+
+    return ERR_NONE;
+
+}
+
+const void *blockdev_map(const struct blockdev *bd, uint32_t sector, uint32_t count) {
+
+    if (bd == NULL || bd->image == NULL)
+        return NULL;
+
+    size_t nbSectors = bd->size / SECTOR_SIZE;
+
+    if (sector >= nbSectors || count > nbSectors - sector)
+        return NULL;
+
+    return bd->image + (size_t) sector * SECTOR_SIZE;
+
+}
+
+/**
+ * @brief have the kernel read ahead the bytes [start, end) of a mapped image
+ */
+static int blockdev_willneed_range(const struct blockdev *bd, size_t start, size_t end) {
+
+    if (end <= start)
+        return ERR_NONE;
+
+    return (madvise(bd->image + start, end - start, MADV_WILLNEED) != 0) ? ERR_IO : ERR_NONE;
+
+}
+
+int blockdev_willneed(const struct blockdev *bd, const uint32_t *sectors, size_t count) {
+
+    M_REQUIRE_NON_NULL(bd);
+    M_REQUIRE_NON_NULL(sectors);
+
+    // a RAM image is already resident, a file-based one is read ahead through the cache
+    if (bd->ops != &mmap_ops)
+        return ERR_NONE;
+
+    // madvise() wants a page-aligned start, and the runs of a file often share
+    // pages: the sectors are gathered in ranges of pages, one madvise() each
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t start = 0, end = 0;
+
+    for (size_t i = 0; i < count; i++) {
+
+        if (blockdev_map(bd, sectors[i], 1) == NULL)
+            return ERR_IO;
+
+        size_t first = (size_t) sectors[i] * SECTOR_SIZE;
+        size_t last = first + SECTOR_SIZE;
+
+        first -= first % page;
+
+        // in the pending range, or in the page following it
+        if (end > start && first >= start && first <= end) {
+            end = MAX(end, last);
+            continue;
+        }
+
+        int adviseCheck = blockdev_willneed_range(bd, start, end);
+
+        if (adviseCheck != ERR_NONE)
+            return adviseCheck;
+
+        start = first;
+        end = last;
+
+    }
+
+    return blockdev_willneed_range(bd, start, end);
+
+}
+
+int blockdev_fd(const struct blockdev *bd) {
+
+    if (bd == NULL)
+        return -1;
+
+    if (bd->ops == &stdio_ops)
+        return fileno(bd->f);
+
+    if (bd->ops == &pread_ops)
+        return bd->fd;
+
+    return -1;
+
+}
+
+int blockdev_type_from_name(const char *name) {
+
+    M_REQUIRE_NON_NULL(name);
+
+    for (int type = 0; type < BLOCKDEV_NB_TYPES; type++) {
+
+        if (strcmp(blockdev_types[type]->name, name) == 0)
+            return type;
+
+    }
+
+    return ERR_BAD_PARAMETER;
+
+}
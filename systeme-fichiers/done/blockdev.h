@@ -0,0 +1,139 @@
+#pragma once
+
+/**
+ * @file blockdev.h
+ * @brief block-device backends underneath a mounted filesystem
+ *
+ * A mounted filesystem never touches its image directly: every sector
+ * goes through the operations of its struct blockdev, so that the way
+ * the image is accessed can be chosen at mount time.
+ */
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <stdio.h>
+#include "iostats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum blockdev_type {
+    BLOCKDEV_STDIO,     // FILE and sector_read()/sector_write(), see sector.h
+    BLOCKDEV_PREAD,     // file descriptor and pread()/pwrite()
+    BLOCKDEV_MMAP,      // the whole image mapped in memory
+    BLOCKDEV_RAM,       // the whole image copied in memory; writes are never written back
+    BLOCKDEV_DIRECT,    // file descriptor opened with O_DIRECT: no kernel page cache
+    BLOCKDEV_NB_TYPES
+};
+
+struct blockdev;
+struct blockdev_pool;
+
+struct blockdev_ops {
+    const char *name;
+    int (*read)(const struct blockdev *bd, uint32_t sector, uint32_t count, void *data);
+    int (*write)(struct blockdev *bd, uint32_t sector, uint32_t count, const void *data);
+    int (*close)(struct blockdev *bd);
+};
+
+struct blockdev {
+    const struct blockdev_ops *ops;
+    FILE *f;            // BLOCKDEV_STDIO
+    int fd;             // BLOCKDEV_PREAD and BLOCKDEV_DIRECT
+    uint8_t *image;     // BLOCKDEV_MMAP and BLOCKDEV_RAM: the whole image
+    size_t size;        // size of the image, in bytes (all but BLOCKDEV_STDIO and BLOCKDEV_PREAD)
+    int writable;       // 0 if writes must be refused
+    size_t align;       // BLOCKDEV_DIRECT: logical block size, the alignment of every I/O
+    struct blockdev_pool *pool; // BLOCKDEV_DIRECT: aligned bounce buffers, and the lock that orders writes
+    struct iostats *stats;      // where blockdev_read()/blockdev_write() are recorded; NULL for none
+};
+
+/**
+ * @brief open a disk image with the given backend
+ * @param bd the block device (OUT)
+ * @param filename the disk image (IN)
+ * @param type the backend to use
+ * @param writable 0 to open the image read-only
+ * @return 0 on success; <0 on error
+ */
+int blockdev_open(struct blockdev *bd, const char *filename, enum blockdev_type type, int writable);
+
+/**
+ * @brief close a block device and release its resources
+ * @param bd the block device
+ * @return 0 on success; <0 on error
+ */
+int blockdev_close(struct blockdev *bd);
+
+/**
+ * @brief read a run of contiguous sectors
+ * @param bd the block device
+ * @param sector the first sector of the run
+ * @param count the number of sectors in the run
+ * @param data a pointer to count*512 bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int blockdev_read(const struct blockdev *bd, uint32_t sector, uint32_t count, void *data);
+
+/**
+ * @brief write a run of contiguous sectors
+ * @param bd the block device
+ * @param sector the first sector of the run
+ * @param count the number of sectors in the run
+ * @param data a pointer to count*512 bytes of memory (IN)
+ * @return 0 on success; ERR_READ_ONLY if the device is not writable; <0 on error
+ */
+int blockdev_write(struct blockdev *bd, uint32_t sector, uint32_t count, const void *data);
+
+/**
+ * @brief read a list of sectors, one backend read per contiguous run (see sector_readv())
+ * @param bd the block device
+ * @param sectors the sectors to read (IN)
+ * @param count the number of entries in sectors
+ * @param data a pointer to count*512 bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int blockdev_readv(const struct blockdev *bd, const uint32_t *sectors, size_t count, void *data);
+
+/**
+ * @brief direct access to count contiguous sectors of an in-memory backend
+ * @param bd the block device
+ * @param sector the first sector
+ * @param count the number of sectors that will be accessed
+ * @return a read-only pointer to the sectors; NULL if the backend does not keep
+ *         the image in memory or if the range lies outside of the image
+ */
+const void *blockdev_map(const struct blockdev *bd, uint32_t sector, uint32_t count);
+
+/**
+ * @brief announce that a list of sectors will be read soon: the kernel starts
+ *        reading the pages of a mapped image (BLOCKDEV_MMAP) that hold them,
+ *        with one madvise(MADV_WILLNEED) per range of pages; the other backends
+ *        ignore it (a RAM image is resident, the file-based ones read ahead
+ *        into the sector cache, see bcache_prefetch())
+ * @param bd the block device
+ * @param sectors the sectors that will be read (IN)
+ * @param count the number of entries in sectors
+ * @return 0 on success; <0 on error
+ */
+int blockdev_willneed(const struct blockdev *bd, const uint32_t *sectors, size_t count);
+
+/**
+ * @brief the file descriptor under a file-based backend (BLOCKDEV_STDIO or
+ *        BLOCKDEV_PREAD), to issue asynchronous reads on it (see ioengine.h)
+ * @param bd the block device
+ * @return the descriptor; -1 for the other backends
+ */
+int blockdev_fd(const struct blockdev *bd);
+
+/**
+ * @brief find a backend by its name ("stdio", "pread", "mmap", "ram" or "direct")
+ * @param name the name of the backend
+ * @return the backend type on success; ERR_BAD_PARAMETER if there is no such backend
+ */
+int blockdev_type_from_name(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
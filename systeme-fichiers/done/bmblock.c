@@ -13,9 +13,12 @@
 #include <inttypes.h>
 #include "bmblock.h"
 #include "error.h"
+#include "extmap.h"
 #include "unixv6fs.h"
+#include "util.h"
 
 #define ROUND_UP(_x, _y) ((((_x)+(_y)-1)/(_y))*(_y))
+#define BM_CURSOR_SPREAD 8 // per-thread cursors start 1/BM_CURSOR_SPREAD of the array apart
 
 struct bmblock_array *bm_alloc(uint64_t min, uint64_t max)
 {
@@ -23,8 +26,10 @@ struct bmblock_array *bm_alloc(uint64_t min, uint64_t max)
         return NULL;
     }
     size_t length = (max - min) / BITS_PER_VECTOR + 1; // number of blocks
-    size_t alloc_size = ROUND_UP(sizeof(struct bmblock_array) + (length - 1) * sizeof(uint64_t), SECTOR_SIZE);
+    size_t alloc_size = ROUND_UP(sizeof(struct bmblock_array) + (length - 1 + BM_SUMMARY_LENGTH(length)) * sizeof(uint64_t),
+                                 SECTOR_SIZE);
     // length - 1: since one is already present in the bm field: bm[0] is part of struct bmblock_array
+    // the summary follows the last word of bm
 
     struct bmblock_array *bmblock = malloc(alloc_size);
     if (bmblock == NULL) {
@@ -33,13 +38,25 @@ struct bmblock_array *bm_alloc(uint64_t min, uint64_t max)
 
     memset(bmblock, 0, alloc_size);
     bmblock->length = length;
-    bmblock->max = max - min + 1;
+    bmblock->max = max;
     bmblock->min = min;
     bmblock->cursor = UINT64_C(0);
+    bmblock->summary = bmblock->bm + length;
+
+    // the words past max count as full
+    bm_update_summary(bmblock);
 
     return bmblock;
 }
 
+void bm_free(struct bmblock_array *bmblock_array)
+{
+    if (bmblock_array != NULL) {
+        extmap_free(bmblock_array->extents);
+        free(bmblock_array);
+    }
+}
+
 int bm_get(struct bmblock_array *bmblock_array, uint64_t x)
 {
     if ((x < bmblock_array->min) || (x > bmblock_array->max)) {
@@ -49,23 +66,471 @@ int bm_get(struct bmblock_array *bmblock_array, uint64_t x)
                    >> ((x - bmblock_array->min) % BITS_PER_VECTOR)) & UINT64_C(1));
 }
 
+/**
+ * @brief the bits of word i that hold no value bm_get() accepts, i.e. past max:
+ *        they count as used, so that they are never returned
+ */
+static uint64_t bm_past_max(const struct bmblock_array *bm, size_t i)
+{
+    if (bm->max < bm->min) {
+        return UINT64_MAX;
+    }
+
+    // the index (x - min) of the last value that can be returned
+    const uint64_t last = MIN(bm->max - bm->min, bm->length * BITS_PER_VECTOR - 1);
+    const size_t lastWord = (size_t) (last / BITS_PER_VECTOR);
+
+    if (i != lastWord) {
+        return (i < lastWord) ? UINT64_C(0) : UINT64_MAX;
+    }
+
+    return (last % BITS_PER_VECTOR == BITS_PER_VECTOR - 1) ? UINT64_C(0) : UINT64_MAX << (last % BITS_PER_VECTOR + 1);
+}
+
+/**
+ * @brief the number of values that can be returned, i.e. 1 + the index (x - min) of the last one
+ */
+static uint64_t bm_nb_values(const struct bmblock_array *bm)
+{
+    return (bm->max < bm->min) ? 0 : MIN(bm->max - bm->min, bm->length * BITS_PER_VECTOR - 1) + 1;
+}
+
+/**
+ * @brief the word i of bm; an atomic load, so that the searches can run while
+ *        other threads claim bits
+ */
+static uint64_t bm_load(const struct bmblock_array *bm, size_t i)
+{
+    return __atomic_load_n(&(bm->bm[i]), __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief the bits of the word holding index i that cover [i, end)
+ */
+static uint64_t bm_range_mask(uint64_t i, uint64_t end)
+{
+    const uint64_t bits = MIN(end - i, BITS_PER_VECTOR - i % BITS_PER_VECTOR);
+
+    return ((bits == BITS_PER_VECTOR) ? UINT64_MAX : ((UINT64_C(1) << bits) - 1)) << (i % BITS_PER_VECTOR);
+}
+
+/**
+ * @brief set or clear the summary bit of word i, from its current content
+ */
+static void bm_summarize(struct bmblock_array *bm, size_t i)
+{
+    const uint64_t bit = UINT64_C(1) << (i % BITS_PER_VECTOR);
+
+    if ((bm->bm[i] | bm_past_max(bm, i)) == UINT64_MAX) {
+        bm->summary[i / BITS_PER_VECTOR] |= bit;
+    } else {
+        bm->summary[i / BITS_PER_VECTOR] &= ~bit;
+    }
+}
+
+void bm_update_summary(struct bmblock_array *bmblock_array)
+{
+    if (bmblock_array == NULL) {
+        return;
+    }
+
+    uint64_t nbSet = 0;
+
+    // __builtin_popcountll(): one instruction where the target has it (e.g. -mpopcnt), portable code otherwise
+    for (size_t i = 0; i < bmblock_array->length; ++i) {
+        bm_summarize(bmblock_array, i);
+        nbSet += (uint64_t) __builtin_popcountll(bmblock_array->bm[i] & ~bm_past_max(bmblock_array, i));
+    }
+
+    bmblock_array->nb_set = nbSet;
+
+    // the words changed behind the back of the extents; without them, allocation scans the bits
+    if (bmblock_array->extents != NULL) {
+        bm_attach_extents(bmblock_array);
+    }
+}
+
+uint64_t bm_count_set(const struct bmblock_array *bmblock_array)
+{
+    return (bmblock_array == NULL) ? 0 : __atomic_load_n(&(bmblock_array->nb_set), __ATOMIC_RELAXED);
+}
+
+uint64_t bm_count_free(const struct bmblock_array *bmblock_array)
+{
+    return (bmblock_array == NULL) ? 0 : bm_nb_values(bmblock_array) - bm_count_set(bmblock_array);
+}
+
+/**
+ * @brief the first word of bm[from..to) that is not full, or to if they all are:
+ *        one ctz on the summary per 64 words
+ */
+static size_t bm_skip_full(const struct bmblock_array *bm, size_t from, size_t to)
+{
+    for (size_t i = from; i < to; i = (i / BITS_PER_VECTOR + 1) * BITS_PER_VECTOR) {
+
+        uint64_t notFull = ~__atomic_load_n(&(bm->summary[i / BITS_PER_VECTOR]), __ATOMIC_RELAXED)
+                           & (UINT64_MAX << (i % BITS_PER_VECTOR));
+
+        if (notFull != 0) {
+            return MIN((i / BITS_PER_VECTOR) * BITS_PER_VECTOR + (size_t) __builtin_ctzll(notFull), to);
+        }
+    }
+
+    return to;
+}
+
+/**
+ * @brief bm_find_next() on an array with extents: the start of the smallest free
+ *        extent, as bm_claim_next() would allocate it
+ */
+static int bm_find_best_fit(struct bmblock_array *bm)
+{
+    uint64_t start = 0;
+
+    extmap_lock(bm->extents);
+    const int ret = extmap_find_fit(bm->extents, 1, &start);
+    extmap_unlock(bm->extents);
+
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+
+    bm->cursor = start / BITS_PER_VECTOR;
+    return (int) (bm->min + start);
+}
+
 int bm_find_next(struct bmblock_array *bmblock_array)
 {
     M_REQUIRE_NON_NULL(bmblock_array);
 
-    uint64_t cursor = bmblock_array->cursor;
+    if (bmblock_array->extents != NULL) {
+        return bm_find_best_fit(bmblock_array);
+    }
 
-    for (size_t i = 0; i < bmblock_array->length; ++i) {
-        uint64_t new_cursor = (cursor + i) % bmblock_array->length;
-        bmblock_array->cursor = new_cursor;
-        // we check first if the 64 are ones and jump to the next one if this is the case
-        if (bmblock_array->bm[new_cursor] != UINT64_C(-1)) {
-            for (uint64_t j = 0; j < BITS_PER_VECTOR; ++j) {
-                uint64_t bit = new_cursor * BITS_PER_VECTOR + j + bmblock_array->min;
-                if (bm_get(bmblock_array, bit) == 0) {
-                    assert(bit <= bmblock_array->max && bit >= bmblock_array->min);
-                    return (int) bit;
+    const size_t length = bmblock_array->length;
+    const size_t cursor = (size_t) (bmblock_array->cursor % length);
+
+    // from the cursor to the end, then from the start to the cursor
+    const size_t rounds[2][2] = { { cursor, length }, { 0, cursor } };
+
+    for (size_t r = 0; r < 2; ++r) {
+
+        size_t i = bm_skip_full(bmblock_array, rounds[r][0], rounds[r][1]);
+
+        if (i < rounds[r][1]) {
+            uint64_t word = bmblock_array->bm[i] | bm_past_max(bmblock_array, i);
+
+            bmblock_array->cursor = i;
+            return (int) (bmblock_array->min + i * BITS_PER_VECTOR + (uint64_t) __builtin_ctzll(~word));
+        }
+    }
+
+    // one full round later, as when every word is examined
+    bmblock_array->cursor = (cursor + length - 1) % length;
+
+    return ERR_BITMAP_FULL;
+}
+
+/**
+ * @brief the index (x - min) of the first unused value in [from, to), or to if there is none
+ */
+static uint64_t bm_next_free(const struct bmblock_array *bm, uint64_t from, uint64_t to)
+{
+    uint64_t i = from;
+
+    while (i < to) {
+        const size_t w = (size_t) (i / BITS_PER_VECTOR);
+        const uint64_t free = ~(bm_load(bm, w) | bm_past_max(bm, w)) & (UINT64_MAX << (i % BITS_PER_VECTOR));
+
+        if (free != 0) {
+            return MIN(w * BITS_PER_VECTOR + (uint64_t) __builtin_ctzll(free), to);
+        }
+
+        i = bm_skip_full(bm, w + 1, bm->length) * BITS_PER_VECTOR;
+    }
+
+    return to;
+}
+
+/**
+ * @brief the index (x - min) of the first used value in [from, to), or to if there is none
+ */
+static uint64_t bm_next_used(const struct bmblock_array *bm, uint64_t from, uint64_t to)
+{
+    uint64_t i = from;
+
+    while (i < to) {
+        const size_t w = (size_t) (i / BITS_PER_VECTOR);
+        const uint64_t used = (bm_load(bm, w) | bm_past_max(bm, w)) & (UINT64_MAX << (i % BITS_PER_VECTOR));
+
+        if (used != 0) {
+            return MIN(w * BITS_PER_VECTOR + (uint64_t) __builtin_ctzll(used), to);
+        }
+
+        i = (w + 1) * BITS_PER_VECTOR;
+    }
+
+    return to;
+}
+
+int bm_find_next_from(const struct bmblock_array *bmblock_array, uint64_t goal)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+
+    const uint64_t total = bm_nb_values(bmblock_array);
+    const uint64_t from = (goal >= bmblock_array->min && goal - bmblock_array->min < total)
+                          ? goal - bmblock_array->min : 0;
+
+    // from the goal to the end, then from the start to the goal
+    uint64_t i = bm_next_free(bmblock_array, from, total);
+
+    if (i == total) {
+        i = bm_next_free(bmblock_array, 0, from);
+
+        if (i == from) {
+            return ERR_BITMAP_FULL;
+        }
+    }
+
+    return (int) (bmblock_array->min + i);
+}
+
+int bm_attach_extents(struct bmblock_array *bmblock_array)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+
+    extmap_free(bmblock_array->extents);
+    bmblock_array->extents = extmap_alloc();
+    if (bmblock_array->extents == NULL) {
+        return ERR_NOMEM;
+    }
+
+    // the runs of unused values, in order: none can be merged with another
+    const uint64_t total = bm_nb_values(bmblock_array);
+
+    for (uint64_t i = bm_next_free(bmblock_array, 0, total); i < total; ) {
+        const uint64_t end = bm_next_used(bmblock_array, i, total);
+
+        if (extmap_insert(bmblock_array->extents, i, end - i) != ERR_NONE) {
+            extmap_free(bmblock_array->extents);
+            bmblock_array->extents = NULL;
+            return ERR_NOMEM;
+        }
+
+        i = bm_next_free(bmblock_array, end, total);
+    }
+
+    return ERR_NONE;
+}
+
+uint64_t bm_largest_free(const struct bmblock_array *bmblock_array)
+{
+    if (bmblock_array == NULL) {
+        return 0;
+    }
+
+    if (bmblock_array->extents != NULL) {
+        return extmap_largest(bmblock_array->extents);
+    }
+
+    const uint64_t total = bm_nb_values(bmblock_array);
+    uint64_t largest = 0;
+
+    for (uint64_t i = bm_next_free(bmblock_array, 0, total); i < total; ) {
+        const uint64_t end = bm_next_used(bmblock_array, i, total);
+
+        largest = MAX(largest, end - i);
+        i = bm_next_free(bmblock_array, end, total);
+    }
+
+    return largest;
+}
+
+void bm_set_range(struct bmblock_array *bmblock_array, uint64_t x, uint64_t n)
+{
+    if (bmblock_array == NULL || x < bmblock_array->min) {
+        return;
+    }
+
+    const uint64_t total = bm_nb_values(bmblock_array);
+    uint64_t i = x - bmblock_array->min;
+    const uint64_t end = (i >= total) ? i : i + MIN(n, total - i);
+
+    // a value at a time, through bm_set(), which keeps the extents in step
+    if (bmblock_array->extents != NULL) {
+        for (; i < end; ++i) {
+            bm_set(bmblock_array, bmblock_array->min + i);
+        }
+        return;
+    }
+
+    // a word at a time
+    for (; i < end; i = (i / BITS_PER_VECTOR + 1) * BITS_PER_VECTOR) {
+        const size_t w = (size_t) (i / BITS_PER_VECTOR);
+        const uint64_t mask = bm_range_mask(i, end);
+
+        bmblock_array->nb_set += (uint64_t) __builtin_popcountll(mask & ~bmblock_array->bm[w]);
+        bmblock_array->bm[w] |= mask;
+        bm_summarize(bmblock_array, w);
+    }
+}
+
+/**
+ * @brief the index (x - min) of the first run of n unused values starting in
+ *        [from, end) and ending before end, or end if there is none
+ */
+static uint64_t bm_search_run(const struct bmblock_array *bm, uint64_t n, uint64_t from, uint64_t end)
+{
+    for (uint64_t start = bm_next_free(bm, from, end); start < end; ) {
+        const uint64_t stop = bm_next_used(bm, start, MIN(start + n, end));
+
+        if (stop - start == n) {
+            return start;
+        }
+
+        start = bm_next_free(bm, stop, end);
+    }
+
+    return end;
+}
+
+int bm_find_run(struct bmblock_array *bmblock_array, uint64_t n)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+
+    if (n == 0) {
+        return ERR_BAD_PARAMETER;
+    }
+
+    const uint64_t total = bm_nb_values(bmblock_array);
+    const uint64_t cursor = (bmblock_array->cursor % bmblock_array->length) * BITS_PER_VECTOR;
+
+    // the runs starting from the cursor, then those starting before it
+    const uint64_t rounds[2] = { total, MIN(cursor + n - 1, total) };
+    const uint64_t starts[2] = { MIN(cursor, total), 0 };
+
+    for (size_t r = 0; r < 2; ++r) {
+        const uint64_t start = bm_search_run(bmblock_array, n, starts[r], rounds[r]);
+
+        if (start < rounds[r]) {
+            bm_set_range(bmblock_array, bmblock_array->min + start, n);
+            bmblock_array->cursor = (start + n - 1) / BITS_PER_VECTOR;
+            return (int) (bmblock_array->min + start);
+        }
+    }
+
+    return ERR_BITMAP_FULL;
+}
+
+/**
+ * @brief set or clear the summary bit of word i from its content, while other
+ *        threads may change it: whoever changes a word last leaves its summary bit right
+ */
+static void bm_summarize_atomic(struct bmblock_array *bm, size_t i)
+{
+    const uint64_t bit = UINT64_C(1) << (i % BITS_PER_VECTOR);
+    int full;
+
+    do {
+        full = ((__atomic_load_n(&(bm->bm[i]), __ATOMIC_SEQ_CST) | bm_past_max(bm, i)) == UINT64_MAX);
+
+        if (full) {
+            __atomic_fetch_or(&(bm->summary[i / BITS_PER_VECTOR]), bit, __ATOMIC_SEQ_CST);
+        } else {
+            __atomic_fetch_and(&(bm->summary[i / BITS_PER_VECTOR]), ~bit, __ATOMIC_SEQ_CST);
+        }
+    } while (((__atomic_load_n(&(bm->bm[i]), __ATOMIC_SEQ_CST) | bm_past_max(bm, i)) == UINT64_MAX) != full);
+}
+
+/**
+ * @brief atomically set the bits of the indexes [from, from + n), a word at a
+ *        time with a compare-and-swap; if another thread set one of them first,
+ *        give back the words already set
+ * @return 1 if the whole range was set, 0 otherwise
+ */
+static int bm_claim_range(struct bmblock_array *bm, uint64_t from, uint64_t n)
+{
+    const uint64_t end = from + n;
+
+    for (uint64_t i = from; i < end; i = (i / BITS_PER_VECTOR + 1) * BITS_PER_VECTOR) {
+        const size_t w = (size_t) (i / BITS_PER_VECTOR);
+        const uint64_t mask = bm_range_mask(i, end);
+        uint64_t old = bm_load(bm, w);
+
+        do {
+            if ((old & mask) != 0) {
+                for (uint64_t j = from; j < i; j = (j / BITS_PER_VECTOR + 1) * BITS_PER_VECTOR) {
+                    __atomic_fetch_and(&(bm->bm[j / BITS_PER_VECTOR]), ~bm_range_mask(j, i), __ATOMIC_SEQ_CST);
                 }
+                return 0;
+            }
+        } while (!__atomic_compare_exchange_n(&(bm->bm[w]), &old, old | mask, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    }
+
+    __atomic_fetch_add(&(bm->nb_set), n, __ATOMIC_RELAXED);
+
+    for (uint64_t i = from; i < end; i = (i / BITS_PER_VECTOR + 1) * BITS_PER_VECTOR) {
+        bm_summarize_atomic(bm, (size_t) (i / BITS_PER_VECTOR));
+    }
+
+    return 1;
+}
+
+/**
+ * @brief bm_claim_run() on an array with extents: the best fit, under their lock
+ */
+static int bm_claim_best_fit(struct bmblock_array *bm, uint64_t n)
+{
+    uint64_t start = 0;
+
+    extmap_lock(bm->extents);
+
+    int ret = extmap_best_fit(bm->extents, n, &start);
+
+    // free in the extents, so in the bits: only the holders of the lock set them
+    if (ret == ERR_NONE) {
+        bm_claim_range(bm, start, n);
+        ret = (int) (bm->min + start);
+    }
+
+    extmap_unlock(bm->extents);
+
+    return ret;
+}
+
+int bm_claim_run(struct bmblock_array *bmblock_array, uint64_t n, uint64_t *cursor)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+    M_REQUIRE_NON_NULL(cursor);
+
+    if (n == 0) {
+        return ERR_BAD_PARAMETER;
+    }
+
+    if (bmblock_array->extents != NULL) {
+        return bm_claim_best_fit(bmblock_array, n);
+    }
+
+    // a thread's first search starts away from those of the threads before it
+    if (*cursor == BM_CURSOR_UNSET) {
+        *cursor = __atomic_fetch_add(&(bmblock_array->next_cursor), bmblock_array->length / BM_CURSOR_SPREAD + 1,
+                                     __ATOMIC_RELAXED);
+    }
+
+    const uint64_t total = bm_nb_values(bmblock_array);
+    const uint64_t from = (*cursor % bmblock_array->length) * BITS_PER_VECTOR;
+
+    // as bm_find_run()
+    const uint64_t rounds[2] = { total, MIN(from + n - 1, total) };
+    const uint64_t starts[2] = { MIN(from, total), 0 };
+
+    for (size_t r = 0; r < 2; ++r) {
+        for (uint64_t start = bm_search_run(bmblock_array, n, starts[r], rounds[r]); start < rounds[r];
+             start = bm_search_run(bmblock_array, n, start + 1, rounds[r])) {
+
+            if (bm_claim_range(bmblock_array, start, n)) {
+                *cursor = (start + n - 1) / BITS_PER_VECTOR;
+                return (int) (bmblock_array->min + start);
             }
         }
     }
@@ -73,19 +538,125 @@ int bm_find_next(struct bmblock_array *bmblock_array)
     return ERR_BITMAP_FULL;
 }
 
+int bm_try_claim(struct bmblock_array *bmblock_array, uint64_t x, uint64_t n)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+
+    const uint64_t total = bm_nb_values(bmblock_array);
+
+    if (n == 0 || x < bmblock_array->min || x - bmblock_array->min >= total || n > total - (x - bmblock_array->min)) {
+        return ERR_BAD_PARAMETER;
+    }
+
+    if (bmblock_array->extents == NULL) {
+        return bm_claim_range(bmblock_array, x - bmblock_array->min, n) ? ERR_NONE : ERR_BITMAP_FULL;
+    }
+
+    extmap_lock(bmblock_array->extents);
+
+    // not all in one extent: one of them is set
+    int ret = extmap_remove(bmblock_array->extents, x - bmblock_array->min, n);
+
+    if (ret == ERR_NONE) {
+        bm_claim_range(bmblock_array, x - bmblock_array->min, n);
+    } else if (ret == ERR_BAD_PARAMETER) {
+        ret = ERR_BITMAP_FULL;
+    }
+
+    extmap_unlock(bmblock_array->extents);
+
+    return ret;
+}
+
+uint64_t *bm_cursor_of(struct bm_cursor *cursor, const struct bmblock_array *bmblock_array)
+{
+    // a position in another array would only be a bad first guess, but would never be replaced
+    if (cursor->array != bmblock_array) {
+        cursor->array = bmblock_array;
+        cursor->position = BM_CURSOR_UNSET;
+    }
+
+    return &(cursor->position);
+}
+
+int bm_claim_next(struct bmblock_array *bmblock_array, uint64_t *cursor)
+{
+    return bm_claim_run(bmblock_array, 1, cursor);
+}
+
+void bm_release(struct bmblock_array *bmblock_array, uint64_t x)
+{
+    if (bmblock_array == NULL || x < bmblock_array->min || x - bmblock_array->min >= bm_nb_values(bmblock_array)) {
+        return;
+    }
+
+    const size_t w = (size_t) ((x - bmblock_array->min) / BITS_PER_VECTOR);
+    const uint64_t bit = UINT64_C(1) << ((x - bmblock_array->min) % BITS_PER_VECTOR);
+
+    if (bmblock_array->extents != NULL) {
+        extmap_lock(bmblock_array->extents);
+
+        // if the extents cannot take it back, the value stays set: lost until the next mount
+        if ((bm_load(bmblock_array, w) & bit) == 0
+            || extmap_insert(bmblock_array->extents, x - bmblock_array->min, 1) != ERR_NONE) {
+            extmap_unlock(bmblock_array->extents);
+            return;
+        }
+    }
+
+    if ((__atomic_fetch_and(&(bmblock_array->bm[w]), ~bit, __ATOMIC_SEQ_CST) & bit) != 0) {
+        __atomic_fetch_sub(&(bmblock_array->nb_set), 1, __ATOMIC_RELAXED);
+        bm_summarize_atomic(bmblock_array, w);
+    }
+
+    if (bmblock_array->extents != NULL) {
+        extmap_unlock(bmblock_array->extents);
+    }
+}
+
+/**
+ * @brief keep the extents of an array in step with a bit that bm_set() or
+ *        bm_clear() changes; if they cannot be, drop them: allocation then scans the bits
+ */
+static void bm_update_extents(struct bmblock_array *bm, uint64_t i, int set)
+{
+    const int ret = set ? extmap_remove(bm->extents, i, 1) : extmap_insert(bm->extents, i, 1);
+
+    if (ret != ERR_NONE) {
+        extmap_free(bm->extents);
+        bm->extents = NULL;
+    }
+}
+
 void bm_set(struct bmblock_array *bmblock_array, uint64_t x)
 {
     if (x <= bmblock_array->max && x >= bmblock_array->min) {
-        bmblock_array->bm[(x - bmblock_array->min) / BITS_PER_VECTOR] |= (UINT64_C(1)
-                << ((x - bmblock_array->min) % BITS_PER_VECTOR));
+        uint64_t *word = &(bmblock_array->bm[(x - bmblock_array->min) / BITS_PER_VECTOR]);
+        const uint64_t bit = UINT64_C(1) << ((x - bmblock_array->min) % BITS_PER_VECTOR);
+
+        if (bmblock_array->extents != NULL && (*word & bit) == 0) {
+            bm_update_extents(bmblock_array, x - bmblock_array->min, 1);
+        }
+
+        bmblock_array->nb_set += ((*word & bit) == 0);
+        *word |= bit;
+        bm_summarize(bmblock_array, (x - bmblock_array->min) / BITS_PER_VECTOR);
     }
 }
 
 void bm_clear(struct bmblock_array *bmblock_array, uint64_t x)
 {
     if (x <= bmblock_array->max && x >= bmblock_array->min) {
-        bmblock_array->bm[(x - bmblock_array->min) / BITS_PER_VECTOR] &= ~(UINT64_C(1)
-                << ((x - bmblock_array->min) % BITS_PER_VECTOR));
+        uint64_t *word = &(bmblock_array->bm[(x - bmblock_array->min) / BITS_PER_VECTOR]);
+        const uint64_t bit = UINT64_C(1) << ((x - bmblock_array->min) % BITS_PER_VECTOR);
+
+        if (bmblock_array->extents != NULL && (*word & bit) != 0) {
+            bm_update_extents(bmblock_array, x - bmblock_array->min, 0);
+        }
+
+        bmblock_array->nb_set -= ((*word & bit) != 0);
+        *word &= ~bit;
+        bm_summarize(bmblock_array, (x - bmblock_array->min) / BITS_PER_VECTOR);
     }
 }
 
@@ -11,17 +11,52 @@
 #include <stddef.h> // for size_t
 #include <stdint.h>
 
+struct extmap;
 
 struct bmblock_array {
     uint64_t cursor;    // the current position of our cursor (used by find_next)
     uint64_t min;       // the minimum value of our struct
     uint64_t max;       // the maximum value of our struct
     size_t length;      // the (byte) length of our array of bits
+    uint64_t nb_set;    // the number of values whose bit is set (see bm_count_set)
+    uint64_t next_cursor; // where the next per-thread cursor starts (see bm_claim_run)
+    uint64_t *summary;  // one bit per word of bm, set when that word is full (allocated after bm)
+    struct extmap *extents; // free extents of the array, NULL unless bm_attach_extents() was called
     uint64_t bm[1];     // the array that will be extended and will contain our bits
 };
 
 #define BITS_PER_VECTOR (8*sizeof(((struct bmblock_array*)0)->bm[0]))
 
+// number of words of the summary of a bitmap of _length words
+#define BM_SUMMARY_LENGTH(_length) (((_length) + BITS_PER_VECTOR - 1) / BITS_PER_VECTOR)
+
+// initial value of a per-thread cursor, placed by its first bm_claim_run()
+#define BM_CURSOR_UNSET UINT64_MAX
+
+// a per-thread cursor, valid for one array only (see bm_cursor_of())
+struct bm_cursor {
+    const struct bmblock_array *array; // the array position belongs to, NULL at first
+    uint64_t position;                 // as passed to bm_claim_run()
+};
+
+/*
+ * Concurrent allocation: bm_claim_run(), bm_claim_next() and bm_release() can
+ * be called by several threads at once on the same array, without a lock.
+ * They claim bits with a compare-and-swap on their 64-bit word and keep the
+ * summary and the count up to date atomically. Each thread searches from its
+ * own cursor, so that threads do not all contend for the same words. While
+ * they run, no other function of this file may modify the array.
+ *
+ * Extents: bm_attach_extents() indexes the free values of an array by extent
+ * (see extmap.h). bm_claim_run(), bm_claim_next() and bm_find_next() then
+ * allocate by best fit in O(log n) instead of scanning from a cursor, and
+ * bm_largest_free() answers in O(1). bm_find_next_from() and bm_find_run()
+ * stay bit-based: they search from a given place by definition. The bits stay
+ * the reference, and every function keeps the extents in step with them;
+ * bm_claim_run(), bm_claim_next(), bm_find_next(), bm_try_claim() and
+ * bm_release() serialize on the lock of the extents.
+ */
+
 /**
  * @brief allocate a new bmblock_array to handle elements indexed
  * between min and max (included, thus (max-min+1) elements).
@@ -31,6 +66,20 @@ struct bmblock_array {
  */
 struct bmblock_array *bm_alloc(uint64_t min, uint64_t max);
 
+/**
+ * @brief free an array allocated by bm_alloc(), and its extents
+ * @param bmblock_array the array, may be NULL
+ */
+void bm_free(struct bmblock_array *bmblock_array);
+
+/**
+ * @brief index the unused values of a filled array by extent, see extmap.h;
+ *        if it already was, the extents are rebuilt
+ * @param bmblock_array the array
+ * @return 0 on success; ERR_NOMEM on failure (the array then has no extents)
+ */
+int bm_attach_extents(struct bmblock_array *bmblock_array);
+
 /**
  * @brief return the bit associated to the given value
  * @param bmblock_array the array containing the value we want to read
@@ -54,12 +103,121 @@ void bm_set(struct bmblock_array *bmblock_array, uint64_t x);
 void bm_clear(struct bmblock_array *bmblock_array, uint64_t x);
 
 /**
- * @brief return the next unused bit
+ * @brief recompute the summary and the count of set values of a bitmap whose
+ *        words were written directly (bm_set() and bm_clear() keep them up to date themselves)
+ * @param bmblock_array the array whose bm was modified
+ */
+void bm_update_summary(struct bmblock_array *bmblock_array);
+
+/**
+ * @brief return the number of set values, in O(1)
+ * @param bmblock_array the array we want to count
+ * @return the number of values whose bit is set
+ */
+uint64_t bm_count_set(const struct bmblock_array *bmblock_array);
+
+/**
+ * @brief return the number of unused values, in O(1)
+ * @param bmblock_array the array we want to count
+ * @return the number of values between min and max whose bit is not set
+ */
+uint64_t bm_count_free(const struct bmblock_array *bmblock_array);
+
+/**
+ * @brief return the length of the longest run of unused values: in O(1) with
+ *        extents (see bm_attach_extents()), by a scan of the array otherwise
+ * @param bmblock_array the array we want to search
+ * @return the number of values of the longest run, 0 if all are set
+ */
+uint64_t bm_largest_free(const struct bmblock_array *bmblock_array);
+
+/**
+ * @brief return the next unused bit from the cursor, or the first value of the
+ * smallest free extent if the array has extents (see bm_attach_extents())
  * @param bmblock_array the array we want to search for place
  * @return <0 on failure, the value of the next unused value otherwise
  */
 int bm_find_next(struct bmblock_array *bmblock_array);
 
+/**
+ * @brief set to true (or 1) the bits of n consecutive values; those out of the
+ * bounds are ignored, as by bm_set()
+ * @param bmblock_array the array containing the values we want to set
+ * @param x the first value
+ * @param n the number of values
+ */
+void bm_set_range(struct bmblock_array *bmblock_array, uint64_t x, uint64_t n);
+
+/**
+ * @brief return the first unused value at or after goal, wrapping around to min;
+ * the cursor is left untouched. Only reads the array: safe while other threads
+ * call bm_claim_run(), but the value may be claimed by one of them before the
+ * caller sets it (see bm_try_claim())
+ * @param bmblock_array the array we want to search for place
+ * @param goal where to start, e.g. right after the last value allocated to the same file;
+ * out of the bounds, the search starts at min
+ * @return <0 on failure, the value of the next unused value otherwise
+ */
+int bm_find_next_from(const struct bmblock_array *bmblock_array, uint64_t goal);
+
+/**
+ * @brief find n consecutive unused values and set them (next fit: the search
+ * starts at the cursor, as for bm_find_next(), and the cursor then moves to the
+ * end of the run)
+ * @param bmblock_array the array we want to search for place
+ * @param n the number of values
+ * @return <0 on failure (ERR_BITMAP_FULL if there is no such run), the first value of the run otherwise
+ */
+int bm_find_run(struct bmblock_array *bmblock_array, uint64_t n);
+
+/**
+ * @brief atomically find and set n consecutive unused values, searching from the
+ * given cursor (next fit, as bm_find_run()), or by best fit if the array has extents
+ * (the cursor is then ignored); safe to call from several threads at once
+ * @param bmblock_array the array we want to search for place
+ * @param n the number of values
+ * @param cursor the calling thread's cursor, BM_CURSOR_UNSET at first (IN-OUT)
+ * @return <0 on failure (ERR_BITMAP_FULL if there is no such run), the first value of the run otherwise
+ */
+int bm_claim_run(struct bmblock_array *bmblock_array, uint64_t n, uint64_t *cursor);
+
+/**
+ * @brief atomically set the n values from x if none of them is set yet;
+ * safe to call from several threads at once
+ * @param bmblock_array the array containing the values we want to set
+ * @param x the first value
+ * @param n the number of values
+ * @return 0 if they were all set; ERR_BITMAP_FULL if one was already set (then none is);
+ * ERR_BAD_PARAMETER if they are not all within the bounds
+ */
+int bm_try_claim(struct bmblock_array *bmblock_array, uint64_t x, uint64_t n);
+
+/**
+ * @brief atomically find and set one unused value, see bm_claim_run()
+ * @param bmblock_array the array we want to search for place
+ * @param cursor the calling thread's cursor, BM_CURSOR_UNSET at first (IN-OUT)
+ * @return <0 on failure, the value set otherwise
+ */
+int bm_claim_next(struct bmblock_array *bmblock_array, uint64_t *cursor);
+
+/**
+ * @brief return the position of a thread's cursor within an array, to pass to
+ * bm_claim_run() or bm_claim_next(); if the cursor was last used with another
+ * array (another bitmap, or another mount), it starts over at BM_CURSOR_UNSET
+ * @param cursor the thread's cursor, e.g. a _Thread_local one (IN-OUT)
+ * @param bmblock_array the array it is about to search
+ * @return a pointer to the position of the cursor
+ */
+uint64_t *bm_cursor_of(struct bm_cursor *cursor, const struct bmblock_array *bmblock_array);
+
+/**
+ * @brief atomically clear the bit of a value, e.g. one set by bm_claim_run();
+ * safe to call from several threads at once
+ * @param bmblock_array the array containing the value we want to clear
+ * @param x the value
+ */
+void bm_release(struct bmblock_array *bmblock_array, uint64_t x);
+
 /**
  * @brief usefull to see (and debug) content of a bmblock_array
  * @param name the name of the printed block
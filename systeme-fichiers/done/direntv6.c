@@ -123,6 +123,11 @@ int direntv6_print_tree(const struct unix_filesystem *u, uint16_t inr, const cha
                 return readDirCheck;
             } 
 
+            // the directory itself and its parent, e.g. in the root written by mountv6_mkfs()
+            if (strcmp(next, ".") == 0 || strcmp(next, "..") == 0) {
+                continue;
+            }
+
             char *nextPrinted = calloc(strlen(prefix) + DIRENT_MAXLEN + 2, sizeof(char));
             strncpy(nextPrinted, prefix, strlen(prefix));
             nextPrinted[strlen(prefix)] = '/';
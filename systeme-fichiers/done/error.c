@@ -18,5 +18,6 @@ const char * const ERR_MESSAGES[] = {
     "file too large",
     "offset out of range",
     "bad parameter",
-    "no such file"
+    "no such file",
+    "read-only filesystem"
 };
@@ -0,0 +1,415 @@
+/**
+ * @file extmap.c
+ * @brief free-space map indexed by extents, in two AVL trees
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "extmap.h"
+#include "error.h"
+
+struct extmap *extmap_alloc(void)
+{
+    struct extmap *map = calloc(1, sizeof(struct extmap));
+    if (map == NULL) {
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&(map->lock), NULL) != 0) {
+        free(map);
+        return NULL;
+    }
+
+    return map;
+}
+
+/**
+ * @brief free the nodes of a subtree of the start order
+ */
+static void extmap_free_nodes(struct extmap_node *node)
+{
+    while (node != NULL) {
+        struct extmap_node *right = node->link[EXTMAP_BY_START].right;
+        extmap_free_nodes(node->link[EXTMAP_BY_START].left);
+        free(node);
+        node = right;
+    }
+}
+
+void extmap_free(struct extmap *map)
+{
+    if (map == NULL) {
+        return;
+    }
+
+    extmap_free_nodes(map->root[EXTMAP_BY_START]);
+    pthread_mutex_destroy(&(map->lock));
+    free(map);
+}
+
+void extmap_lock(struct extmap *map)
+{
+    pthread_mutex_lock(&(map->lock));
+}
+
+void extmap_unlock(struct extmap *map)
+{
+    pthread_mutex_unlock(&(map->lock));
+}
+
+uint64_t extmap_largest(const struct extmap *map)
+{
+    return map == NULL ? 0 : map->largest;
+}
+
+// ======================================================================
+// AVL trees, one per order, linked through node->link[order]
+
+/**
+ * @brief <0, 0 or >0 as a comes before, is or comes after b in the given order
+ */
+static int extmap_cmp(enum extmap_order order, const struct extmap_node *a, const struct extmap_node *b)
+{
+    if (order == EXTMAP_BY_SIZE && a->length != b->length) {
+        return a->length < b->length ? -1 : 1;
+    }
+    return (a->start > b->start) - (a->start < b->start);
+}
+
+static int extmap_height(enum extmap_order order, const struct extmap_node *node)
+{
+    return node == NULL ? 0 : node->link[order].height;
+}
+
+static void extmap_update(enum extmap_order order, struct extmap_node *node)
+{
+    const int left = extmap_height(order, node->link[order].left);
+    const int right = extmap_height(order, node->link[order].right);
+
+    node->link[order].height = (left > right ? left : right) + 1;
+}
+
+static struct extmap_node *extmap_rotate_right(enum extmap_order order, struct extmap_node *node)
+{
+    struct extmap_node *left = node->link[order].left;
+
+    node->link[order].left = left->link[order].right;
+    left->link[order].right = node;
+    extmap_update(order, node);
+    extmap_update(order, left);
+
+    return left;
+}
+
+static struct extmap_node *extmap_rotate_left(enum extmap_order order, struct extmap_node *node)
+{
+    struct extmap_node *right = node->link[order].right;
+
+    node->link[order].right = right->link[order].left;
+    right->link[order].left = node;
+    extmap_update(order, node);
+    extmap_update(order, right);
+
+    return right;
+}
+
+/**
+ * @brief restore the balance of a subtree whose children differ in height by at most 2
+ * @return the new root of the subtree
+ */
+static struct extmap_node *extmap_balance(enum extmap_order order, struct extmap_node *node)
+{
+    struct extmap_link *link = &(node->link[order]);
+    const int balance = extmap_height(order, link->left) - extmap_height(order, link->right);
+
+    if (balance > 1) {
+        const struct extmap_link *left = &(link->left->link[order]);
+        if (extmap_height(order, left->left) < extmap_height(order, left->right)) {
+            link->left = extmap_rotate_left(order, link->left);
+        }
+        return extmap_rotate_right(order, node);
+    }
+
+    if (balance < -1) {
+        const struct extmap_link *right = &(link->right->link[order]);
+        if (extmap_height(order, right->right) < extmap_height(order, right->left)) {
+            link->right = extmap_rotate_right(order, link->right);
+        }
+        return extmap_rotate_left(order, node);
+    }
+
+    extmap_update(order, node);
+    return node;
+}
+
+static struct extmap_node *extmap_tree_insert(enum extmap_order order, struct extmap_node *root,
+                                              struct extmap_node *node)
+{
+    if (root == NULL) {
+        node->link[order].left = NULL;
+        node->link[order].right = NULL;
+        node->link[order].height = 1;
+        return node;
+    }
+
+    if (extmap_cmp(order, node, root) < 0) {
+        root->link[order].left = extmap_tree_insert(order, root->link[order].left, node);
+    } else {
+        root->link[order].right = extmap_tree_insert(order, root->link[order].right, node);
+    }
+
+    return extmap_balance(order, root);
+}
+
+/**
+ * @brief unlink the first node of a subtree
+ * @param first the node unlinked (OUT)
+ * @return the new root of the subtree
+ */
+static struct extmap_node *extmap_tree_remove_first(enum extmap_order order, struct extmap_node *root,
+                                                    struct extmap_node **first)
+{
+    if (root->link[order].left == NULL) {
+        *first = root;
+        return root->link[order].right;
+    }
+
+    root->link[order].left = extmap_tree_remove_first(order, root->link[order].left, first);
+    return extmap_balance(order, root);
+}
+
+/**
+ * @brief unlink a node, which must be in the subtree
+ * @return the new root of the subtree
+ */
+static struct extmap_node *extmap_tree_remove(enum extmap_order order, struct extmap_node *root,
+                                              const struct extmap_node *node)
+{
+    const int cmp = extmap_cmp(order, node, root);
+
+    if (cmp < 0) {
+        root->link[order].left = extmap_tree_remove(order, root->link[order].left, node);
+    } else if (cmp > 0) {
+        root->link[order].right = extmap_tree_remove(order, root->link[order].right, node);
+    } else {
+        struct extmap_node *left = root->link[order].left;
+        struct extmap_node *right = root->link[order].right;
+        struct extmap_node *next = NULL;
+
+        if (right == NULL) {
+            return left;
+        }
+
+        // the next node takes its place
+        right = extmap_tree_remove_first(order, right, &next);
+        next->link[order].left = left;
+        next->link[order].right = right;
+        return extmap_balance(order, next);
+    }
+
+    return extmap_balance(order, root);
+}
+
+// ======================================================================
+// lookups and updates of the map
+
+/**
+ * @brief the extent with the largest start <= x, NULL if there is none
+ */
+static struct extmap_node *extmap_floor(const struct extmap *map, uint64_t x)
+{
+    struct extmap_node *found = NULL;
+
+    for (struct extmap_node *node = map->root[EXTMAP_BY_START]; node != NULL; ) {
+        if (node->start <= x) {
+            found = node;
+            node = node->link[EXTMAP_BY_START].right;
+        } else {
+            node = node->link[EXTMAP_BY_START].left;
+        }
+    }
+
+    return found;
+}
+
+/**
+ * @brief the extent with the smallest start > x, NULL if there is none
+ */
+static struct extmap_node *extmap_above(const struct extmap *map, uint64_t x)
+{
+    struct extmap_node *found = NULL;
+
+    for (struct extmap_node *node = map->root[EXTMAP_BY_START]; node != NULL; ) {
+        if (node->start > x) {
+            found = node;
+            node = node->link[EXTMAP_BY_START].left;
+        } else {
+            node = node->link[EXTMAP_BY_START].right;
+        }
+    }
+
+    return found;
+}
+
+/**
+ * @brief recompute the cached length of the largest extent: the last one by size
+ */
+static void extmap_update_largest(struct extmap *map)
+{
+    const struct extmap_node *node = map->root[EXTMAP_BY_SIZE];
+
+    while (node != NULL && node->link[EXTMAP_BY_SIZE].right != NULL) {
+        node = node->link[EXTMAP_BY_SIZE].right;
+    }
+
+    map->largest = (node == NULL) ? 0 : node->length;
+}
+
+/**
+ * @brief change the bounds of an extent; the start may only move within the
+ *        free values around it, so that its place in the start order holds
+ */
+static void extmap_resize(struct extmap *map, struct extmap_node *node, uint64_t start, uint64_t length)
+{
+    map->root[EXTMAP_BY_SIZE] = extmap_tree_remove(EXTMAP_BY_SIZE, map->root[EXTMAP_BY_SIZE], node);
+    map->nb_free = map->nb_free - node->length + length;
+    node->start = start;
+    node->length = length;
+    map->root[EXTMAP_BY_SIZE] = extmap_tree_insert(EXTMAP_BY_SIZE, map->root[EXTMAP_BY_SIZE], node);
+}
+
+static void extmap_link(struct extmap *map, struct extmap_node *node)
+{
+    for (int order = 0; order < EXTMAP_NB_ORDERS; ++order) {
+        map->root[order] = extmap_tree_insert((enum extmap_order) order, map->root[order], node);
+    }
+    ++map->count;
+    map->nb_free += node->length;
+}
+
+static void extmap_unlink(struct extmap *map, struct extmap_node *node)
+{
+    for (int order = 0; order < EXTMAP_NB_ORDERS; ++order) {
+        map->root[order] = extmap_tree_remove((enum extmap_order) order, map->root[order], node);
+    }
+    --map->count;
+    map->nb_free -= node->length;
+}
+
+int extmap_insert(struct extmap *map, uint64_t start, uint64_t length)
+{
+    M_REQUIRE_NON_NULL(map);
+
+    if (length == 0) {
+        return ERR_BAD_PARAMETER;
+    }
+
+    struct extmap_node *before = extmap_floor(map, start);
+    struct extmap_node *after = extmap_above(map, start);
+
+    if (before != NULL && before->start + before->length != start) {
+        before = NULL;
+    }
+    if (after != NULL && after->start != start + length) {
+        after = NULL;
+    }
+
+    if (before != NULL && after != NULL) {
+        const uint64_t merged = before->length + length + after->length;
+        extmap_unlink(map, after);
+        free(after);
+        extmap_resize(map, before, before->start, merged);
+    } else if (before != NULL) {
+        extmap_resize(map, before, before->start, before->length + length);
+    } else if (after != NULL) {
+        extmap_resize(map, after, start, after->length + length);
+    } else {
+        struct extmap_node *node = calloc(1, sizeof(struct extmap_node));
+        if (node == NULL) {
+            return ERR_NOMEM;
+        }
+        node->start = start;
+        node->length = length;
+        extmap_link(map, node);
+    }
+
+    extmap_update_largest(map);
+    return ERR_NONE;
+}
+
+int extmap_remove(struct extmap *map, uint64_t start, uint64_t length)
+{
+    M_REQUIRE_NON_NULL(map);
+
+    struct extmap_node *node = extmap_floor(map, start);
+
+    if (length == 0 || node == NULL || start - node->start >= node->length
+        || length > node->length - (start - node->start)) {
+        return ERR_BAD_PARAMETER;
+    }
+
+    const uint64_t head = start - node->start;
+    const uint64_t tail = node->length - head - length;
+
+    if (head == 0 && tail == 0) {
+        extmap_unlink(map, node);
+        free(node);
+    } else if (head == 0) {
+        extmap_resize(map, node, start + length, tail);
+    } else if (tail == 0) {
+        extmap_resize(map, node, node->start, head);
+    } else {
+        struct extmap_node *rest = calloc(1, sizeof(struct extmap_node));
+        if (rest == NULL) {
+            return ERR_NOMEM;
+        }
+        rest->start = start + length;
+        rest->length = tail;
+        extmap_resize(map, node, node->start, head);
+        extmap_link(map, rest);
+    }
+
+    extmap_update_largest(map);
+    return ERR_NONE;
+}
+
+int extmap_find_fit(const struct extmap *map, uint64_t length, uint64_t *start)
+{
+    M_REQUIRE_NON_NULL(map);
+    M_REQUIRE_NON_NULL(start);
+
+    if (length == 0) {
+        return ERR_BAD_PARAMETER;
+    }
+
+    if (length > map->largest) {
+        return ERR_BITMAP_FULL;
+    }
+
+    // the first extent, by size, that is long enough
+    const struct extmap_node *found = NULL;
+
+    for (const struct extmap_node *node = map->root[EXTMAP_BY_SIZE]; node != NULL; ) {
+        if (node->length >= length) {
+            found = node;
+            node = node->link[EXTMAP_BY_SIZE].left;
+        } else {
+            node = node->link[EXTMAP_BY_SIZE].right;
+        }
+    }
+
+    *start = found->start;
+    return ERR_NONE;
+}
+
+int extmap_best_fit(struct extmap *map, uint64_t length, uint64_t *start)
+{
+    const int ret = extmap_find_fit(map, length, start);
+
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+
+    // from its start: it only shrinks, no allocation can fail
+    return extmap_remove(map, *start, length);
+}
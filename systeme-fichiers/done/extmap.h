@@ -0,0 +1,128 @@
+#pragma once
+
+/**
+ * @file extmap.h
+ * @brief free-space map indexed by extents
+ *
+ * The free values of an allocator, kept as maximal extents (start, length) in
+ * two AVL trees over the same nodes: one ordered by start, to find the
+ * neighbours of an extent given back, and one ordered by (length, start), to
+ * find the best fit. Both lookups and every update are O(log n) in the number
+ * of extents; the length of the largest one is cached, so that
+ * extmap_largest() is O(1).
+ * The functions do not lock: callers that share a map serialize on its lock
+ * (see extmap_lock()).
+ */
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum extmap_order {
+    EXTMAP_BY_START,            // ordered by start
+    EXTMAP_BY_SIZE,             // ordered by length, then by start
+    EXTMAP_NB_ORDERS
+};
+
+struct extmap_link {
+    struct extmap_node *left;
+    struct extmap_node *right;
+    int height;                 // of the subtree, 1 for a leaf
+};
+
+struct extmap_node {
+    uint64_t start;             // first free value
+    uint64_t length;            // number of free values, > 0
+    struct extmap_link link[EXTMAP_NB_ORDERS];
+};
+
+struct extmap {
+    struct extmap_node *root[EXTMAP_NB_ORDERS];
+    size_t count;               // number of extents
+    uint64_t nb_free;           // sum of their lengths
+    uint64_t largest;           // length of the largest extent, 0 if there is none
+    pthread_mutex_t lock;       // taken by the users of a shared map, see extmap_lock()
+};
+
+/**
+ * @brief allocate an empty map (no value is free)
+ * @return the map, or NULL on failure
+ */
+struct extmap *extmap_alloc(void);
+
+/**
+ * @brief free a map and all its extents
+ * @param map the map, may be NULL
+ */
+void extmap_free(struct extmap *map);
+
+/**
+ * @brief mark the values [start, start + length) free, merging them with the
+ *        extents right before and right after them
+ * @param map the map
+ * @param start the first value
+ * @param length the number of values; none of them may be free already
+ * @return ERR_NONE on success, ERR_NOMEM if a new extent could not be allocated
+ *         (the map is then unchanged), ERR_BAD_PARAMETER if length is 0
+ */
+int extmap_insert(struct extmap *map, uint64_t start, uint64_t length);
+
+/**
+ * @brief mark the values [start, start + length) used, splitting the extent that holds them
+ * @param map the map
+ * @param start the first value
+ * @param length the number of values
+ * @return ERR_NONE on success, ERR_BAD_PARAMETER if they are not all free,
+ *         ERR_NOMEM if the extent had to be split in two and the second part could
+ *         not be allocated (the map is then unchanged)
+ */
+int extmap_remove(struct extmap *map, uint64_t start, uint64_t length);
+
+/**
+ * @brief best fit, without marking anything used: find the smallest extent
+ *        that holds at least length values
+ * @param map the map
+ * @param length the number of values
+ * @param start the first value of that extent (OUT)
+ * @return ERR_NONE on success, ERR_BITMAP_FULL if no extent is long enough,
+ *         ERR_BAD_PARAMETER if length is 0
+ */
+int extmap_find_fit(const struct extmap *map, uint64_t length, uint64_t *start);
+
+/**
+ * @brief best fit: mark used the first length values of the smallest extent
+ *        that holds at least length of them
+ * @param map the map
+ * @param length the number of values
+ * @param start the first of them (OUT)
+ * @return ERR_NONE on success, ERR_BITMAP_FULL if no extent is long enough,
+ *         ERR_BAD_PARAMETER if length is 0
+ */
+int extmap_best_fit(struct extmap *map, uint64_t length, uint64_t *start);
+
+/**
+ * @brief return the length of the largest extent, in O(1)
+ * @param map the map
+ * @return the number of values of the largest extent, 0 if none is free
+ */
+uint64_t extmap_largest(const struct extmap *map);
+
+/**
+ * @brief take the lock of a map shared by several threads
+ * @param map the map
+ */
+void extmap_lock(struct extmap *map);
+
+/**
+ * @brief release the lock taken by extmap_lock()
+ * @param map the map
+ */
+void extmap_unlock(struct extmap *map);
+
+#ifdef __cplusplus
+}
+#endif
@@ -5,9 +5,15 @@
 #include "error.h"
 #include "inode.h"
 #include "sector.h"
+#include "util.h"
 
 #define MAX_FILE_SIZE 7*256*SECTOR_SIZE
 
+static int filev6_writesector(struct filev6 *fv6, const void *buf, size_t len, int newSect);
+
+// where this thread allocates in the block bitmap it last used, see bm_cursor_of()
+static _Thread_local struct bm_cursor filev6_cursor = { NULL, BM_CURSOR_UNSET };
+
 /**
  * @brief open the file corresponding to a given inode; set offset to zero
  * @param u the filesystem (IN)
@@ -37,6 +43,11 @@ int filev6_open(const struct unix_filesystem *u, uint16_t inr, struct filev6 *fv
     // initialise the offset to 0
     fv6->offset = 0;
 
+    // a read from the start counts as sequential
+    fv6->ra_next = 0;
+    fv6->ra_end = 0;
+    fv6->ra_window = 0;
+
     return ERR_NONE;
 
 }
@@ -50,30 +61,114 @@ int filev6_open(const struct unix_filesystem *u, uint16_t inr, struct filev6 *fv
  */
 int filev6_readblock(struct filev6 *fv6, void *buf) {
 
+    return filev6_readblocks(fv6, buf, 1);
+
+}
+
+/**
+ * @brief update the read-ahead window of a file for a read of count sectors at
+ *        firstSector, and prefetch the sectors of the window not requested yet,
+ *        together with the ones of the read itself
+ * @param fv6 the filev6 (IN-OUT; its read-ahead state will be changed)
+ * @param firstSector the first sector (of the file) read
+ * @param count the number of sectors read
+ * @param lastSector the last sector of the file
+ * @return 0 on success; <0 on error
+ */
+static int filev6_readahead(struct filev6 *fv6, int32_t firstSector, size_t count, int32_t lastSector) {
+
+    if (firstSector == fv6->ra_next) {
+
+        fv6->ra_window = (fv6->ra_window == 0) ? FILEV6_RA_MIN : MIN(2 * fv6->ra_window, FILEV6_RA_MAX);
+
+    } else {
+
+        fv6->ra_window /= 2;
+
+        if (fv6->ra_window < FILEV6_RA_MIN) 
+            fv6->ra_window = 0;
+
+        // what was read ahead elsewhere in the file does not cover this read
+        fv6->ra_end = firstSector;
+
+    }
+
+    fv6->ra_next = firstSector + (int32_t) count;
+
+    // how the window is read ahead depends on the backend, see fs_sector_prefetch()
+    if (fv6->ra_window == 0)
+        return ERR_NONE;
+
+    int32_t end = MIN(lastSector + 1, fv6->ra_next + (int32_t) fv6->ra_window);
+
+    // wait until half of the window has been consumed before topping it up
+    if (fv6->ra_end >= fv6->ra_next + (int32_t) fv6->ra_window / 2 || fv6->ra_end >= end)
+        return ERR_NONE;
+
+    int32_t start = (fv6->ra_end > firstSector) ? fv6->ra_end : firstSector;
+    uint32_t sectors[FILEV6_READ_BATCH + FILEV6_RA_MAX];
+    size_t nbSectors = (size_t) (end - start);
+
+    int findCheck = inode_findsectors(fv6->u, &(fv6->i_node), start, nbSectors, sectors);
+
+    if (findCheck != ERR_NONE)
+        return findCheck;
+
+    fv6->ra_end = end;
+
+    return fs_sector_prefetch(fv6->u, sectors, nbSectors);
+
+}
+
+/**
+ * @brief read at most nb_sectors*SECTOR_SIZE bytes from the file at the current cursor
+ * @param fv6 the filev6 (IN-OUT; offset will be changed)
+ * @param buf points to nb_sectors*SECTOR_SIZE bytes of available memory (OUT)
+ * @param nb_sectors the maximum number of sectors to read
+ * @return >0: the number of bytes of the file read; 0: end of file;
+ *             the appropriate error code (<0) on error
+ */
+int filev6_readblocks(struct filev6 *fv6, void *buf, size_t nb_sectors) {
+
     M_REQUIRE_NON_NULL(fv6);
     M_REQUIRE_NON_NULL(buf);
 
     if (!(fv6->i_node.i_mode & IALLOC))
         return ERR_UNALLOCATED_INODE;
 
-    if (inode_getsize(&(fv6->i_node)) - fv6->offset == 0) 
+    int32_t fileSize = inode_getsize(&(fv6->i_node));
+
+    if (fileSize - fv6->offset <= 0) 
         return 0;
 
-    int sector = inode_findsector(fv6->u, &(fv6->i_node), fv6->offset);
+    int32_t firstSector = fv6->offset / SECTOR_SIZE;
+    int32_t lastSector = (fileSize - 1) / SECTOR_SIZE;
 
-    if (sector < ERR_NONE)
-        return sector;
+    size_t count = (size_t) (lastSector - firstSector + 1);
+    count = MIN(count, nb_sectors);
+    count = MIN(count, FILEV6_READ_BATCH);
 
-    int sectorReadCheck = sector_read(fv6->u->f, sector, buf);
+    int readaheadCheck = filev6_readahead(fv6, firstSector, count, lastSector);
+
+    if (readaheadCheck != ERR_NONE)
+        return readaheadCheck;
+
+    // resolve every data sector first, so that contiguous ones are read at once
+    uint32_t sectors[FILEV6_READ_BATCH];
+
+    int findCheck = inode_findsectors(fv6->u, &(fv6->i_node), firstSector, count, sectors);
+
+    if (findCheck != ERR_NONE)
+        return findCheck;
+
+    int sectorReadCheck = fs_sector_readv(fv6->u, sectors, count, buf);
 
     if (sectorReadCheck != ERR_NONE)
         return sectorReadCheck;
 
-    int remainingCheck = (inode_getsize(&(fv6->i_node)) - fv6->offset < SECTOR_SIZE);
-
     int32_t prevOffset = fv6->offset;
 
-    fv6->offset = (remainingCheck) ? inode_getsize(&(fv6->i_node)) : fv6->offset + SECTOR_SIZE;
+    fv6->offset = MIN(fileSize, (firstSector + (int32_t) count) * SECTOR_SIZE);
 
     return fv6->offset - prevOffset;
 
@@ -124,22 +219,83 @@ int filev6_create(struct unix_filesystem *u, uint16_t mode, struct filev6 *fv6)
     if (inr < ERR_NONE)
         return inr;
 
+    // i_number and the directory entries hold 16 bits
+    if (inr > UINT16_MAX)
+        return ERR_INODE_OUT_OF_RANGE;
+
     struct inode inode = { 0 };
 
     inode.i_mode = mode;
 
-    int writeCheck = inode_write(u, inr, &inode);
+    int writeCheck = inode_write(u, (uint16_t) inr, &inode);
 
     if (writeCheck != ERR_NONE)
         return writeCheck;
 
-    fv6->i_number = inr;
+    fv6->i_number = (uint16_t) inr;
     fv6->i_node = inode;
 
     return ERR_NONE;
 
 }
 
+/**
+ * @brief allocate n consecutive sectors for the file, as close after its last
+ *        sector as possible: right after it if they are free; else by best fit
+ *        if the block bitmap has extents; else, for one sector, the first free
+ *        one after it, and otherwise wherever this thread's cursor finds them
+ * @param fv6 the filev6 (IN)
+ * @param n the number of sectors
+ * @return the first sector on success; <0 on error
+ */
+static int filev6_alloc_sectors(struct filev6 *fv6, size_t n) {
+
+    int modifiedCheck = mountv6_modified(fv6->u);
+
+    if (modifiedCheck != ERR_NONE)
+        return modifiedCheck;
+
+    struct bmblock_array *fbm = fv6->u->fbm;
+    size_t used = MIN((size_t) (inode_getsize(&(fv6->i_node)) + SECTOR_SIZE - 1) / SECTOR_SIZE, ADDR_SMALL_LENGTH);
+
+    if (used > 0) {
+
+        uint64_t goal = (uint64_t) fv6->i_node.i_addr[used - 1] + 1;
+
+        if (bm_try_claim(fbm, goal, n) == ERR_NONE)
+            return (int) goal;
+
+        if (n == 1 && fbm->extents == NULL) {
+
+            int near = bm_find_next_from(fbm, goal);
+
+            // another thread may have taken it since: then fall back to the cursor
+            if (near >= ERR_NONE && bm_try_claim(fbm, (uint64_t) near, 1) == ERR_NONE)
+                return near;
+
+        }
+
+    }
+
+    return bm_claim_run(fbm, n, bm_cursor_of(&filev6_cursor, fbm));
+
+}
+
+/**
+ * @brief give back the sectors of a run reserved by filev6_writebytes() that a
+ *        failed write did not use
+ * @param fv6 the filev6 (IN)
+ * @param run the first sector of the run; <0 if none was reserved
+ * @param nbUsed the number of sectors of the run already used
+ * @param nbNew the number of sectors of the run
+ */
+static void filev6_release_run(struct filev6 *fv6, int run, size_t nbUsed, size_t nbNew) {
+
+    for (size_t k = nbUsed; run >= ERR_NONE && k < nbNew; k++)
+        bm_release(fv6->u->fbm, (uint64_t) run + k);
+
+}
+
 /**
  * @brief write the len bytes of the given buffer on disk to the given filev6
  * @param fv6 the filev6 (IN)
@@ -152,23 +308,57 @@ int filev6_writebytes(struct filev6 *fv6, const void *buf, size_t len) {
     M_REQUIRE_NON_NULL(fv6);
     M_REQUIRE_NON_NULL(buf);
 
-    int left = len;
+    // the sectors this write adds to the file are reserved together, so that
+    // they are contiguous when the disk has such a run; only i_addr is filled
+    size_t used = (inode_getsize(&(fv6->i_node)) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    size_t needed = (inode_getsize(&(fv6->i_node)) + len + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    size_t nbNew = MIN(needed, ADDR_SMALL_LENGTH) - MIN(used, ADDR_SMALL_LENGTH);
+    int run = ERR_BITMAP_FULL;
 
-    while (left > 0) {
+    if (nbNew > 1) {
 
-        int writeSectorCheck = filev6_writesector(fv6, buf + len - left, left);
+        int bitmapsCheck = mountv6_bitmaps(fv6->u);
 
-        if (writeSectorCheck != ERR_NONE)
-            return writeSectorCheck;
+        if (bitmapsCheck != ERR_NONE)
+            return bitmapsCheck;
 
-        left -= SECTOR_SIZE;
+        // without such a run, the sectors are allocated one at a time
+        run = filev6_alloc_sectors(fv6, nbNew);
 
     }
 
-    int setSizeCheck = inode_setsize(&(fv6->i_node), inode_getsize(&(fv6->i_node)) + len);
+    size_t written = 0, nbUsed = 0;
+
+    while (written < len) {
+
+        int newSect = -1;
 
-    if (setSizeCheck != ERR_NONE)
-        return setSizeCheck;
+        if (run >= ERR_NONE && inode_getsize(&(fv6->i_node)) % SECTOR_SIZE == 0 && nbUsed < nbNew)
+            newSect = run + (int) nbUsed++;
+
+        int writeSectorCheck = filev6_writesector(fv6, (const char *) buf + written, len - written, newSect);
+
+        if (writeSectorCheck < ERR_NONE) {
+
+            filev6_release_run(fv6, run, nbUsed, nbNew);
+
+            return writeSectorCheck;
+
+        }
+
+        written += (size_t) writeSectorCheck;
+
+        int setSizeCheck = inode_setsize(&(fv6->i_node), inode_getsize(&(fv6->i_node)) + writeSectorCheck);
+
+        if (setSizeCheck != ERR_NONE) {
+
+            filev6_release_run(fv6, run, nbUsed, nbNew);
+
+            return setSizeCheck;
+
+        }
+
+    }
 
     return ERR_NONE;
 
@@ -176,13 +366,15 @@ int filev6_writebytes(struct filev6 *fv6, const void *buf, size_t len) {
 
 
 /**
- * @brief local helper function for filev6_writebytes, writes 512 bytes of data on the given filev6
+ * @brief local helper function for filev6_writebytes, writes up to 512 bytes of data on the given filev6,
+ *        up to the end of its last sector or in a new one
  * @param fv6 the filev6 (IN)
  * @param buf the data we want to write (IN)
  * @param len the length of the bytes we want to write
- * @return 0 on success; <0 on error
+ * @param newSect the sector to use if a new one is needed, already marked in the bitmap; <0 to allocate it
+ * @return the number of bytes written on success; <0 on error
 */
-int filev6_writesector(struct filev6 *fv6, const void *buf, size_t len) {
+static int filev6_writesector(struct filev6 *fv6, const void *buf, size_t len, int newSect) {
 
     int32_t inodeSize = inode_getsize(&(fv6->i_node));
 
@@ -193,14 +385,29 @@ int filev6_writesector(struct filev6 *fv6, const void *buf, size_t len) {
 
     if (inodeSize % SECTOR_SIZE == 0) {
 
+        // the sectors of large files (indirect addressing) are not written
+        if (inodeSize / SECTOR_SIZE >= ADDR_SMALL_LENGTH)
+            return ERR_FILE_TOO_LARGE;
+
         nbBytes = (len > SECTOR_SIZE) ? SECTOR_SIZE : len;
 
-        int newSect = bm_find_next(fv6->u->fbm);
+        if (newSect < ERR_NONE) {
+
+            int bitmapsCheck = mountv6_bitmaps(fv6->u);
 
-        if (newSect < ERR_NONE)
-            return newSect;
+            if (bitmapsCheck != ERR_NONE)
+                return bitmapsCheck;
 
-        bm_set(fv6->u->fbm, newSect);
+            newSect = filev6_alloc_sectors(fv6, 1);
+
+            if (newSect < ERR_NONE)
+                return newSect;
+
+        }
+
+        // i_addr holds 16-bit sector numbers
+        if (newSect > UINT16_MAX)
+            return ERR_BAD_PARAMETER;
 
         char* data = malloc(SECTOR_SIZE);
 
@@ -211,7 +418,7 @@ int filev6_writesector(struct filev6 *fv6, const void *buf, size_t len) {
 
         memcpy(data, buf, nbBytes);
 
-        int sectorWriteCheck = sector_write(fv6->u->f, newSect, data); 
+        int sectorWriteCheck = fs_sector_write(fv6->u, newSect, data); 
 
         if (sectorWriteCheck != ERR_NONE) {
 
@@ -225,7 +432,7 @@ int filev6_writesector(struct filev6 *fv6, const void *buf, size_t len) {
         free(data);
         data = NULL;
 
-        fv6->i_node.i_addr[inode_getsize(fv6->i_node)/SECTOR_SIZE] = newSect;
+        fv6->i_node.i_addr[inodeSize / SECTOR_SIZE] = (uint16_t) newSect;
 
     } else {
 
@@ -238,9 +445,9 @@ int filev6_writesector(struct filev6 *fv6, const void *buf, size_t len) {
         if (sector == NULL)
             return ERR_NOMEM;
 
-        uint32_t sectorNr = inodeSize/SECTOR_SIZE;
+        uint32_t sectorNr = fv6->i_node.i_addr[inodeSize / SECTOR_SIZE];
 
-        int sectorReadCheck = sector_read(fv6->u->f, sectorNr, sector);
+        int sectorReadCheck = fs_sector_read(fv6->u, sectorNr, sector);
 
         if (sectorReadCheck != ERR_NONE) {
 
@@ -251,9 +458,9 @@ int filev6_writesector(struct filev6 *fv6, const void *buf, size_t len) {
 
         }
 
-        memcpy(sector + (inodeSize % SECTOR_SIZE), buf, unusedSectorSize);
+        memcpy(sector + (inodeSize % SECTOR_SIZE), buf, nbBytes);
 
-        int sectorWriteCheck = sector_write(fv6->u->f, sectorNr, sector);
+        int sectorWriteCheck = fs_sector_write(fv6->u, sectorNr, sector);
 
         if (sectorWriteCheck != ERR_NONE) {
 
@@ -267,10 +474,8 @@ int filev6_writesector(struct filev6 *fv6, const void *buf, size_t len) {
         free(sector);
         sector = NULL;
 
-        fv6->i_node.i_addr[(inode_getsize(fv6->i_node) + SECTOR_SIZE - 1)/SECTOR_SIZE] = sectorNr;
-
     }
 
-    return ERR_NONE;
+    return nbBytes;
 
 }
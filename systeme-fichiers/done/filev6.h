@@ -15,11 +15,18 @@
 extern "C" {
 #endif
 
+#define FILEV6_READ_BATCH 64 // max. number of sectors fetched by one filev6_readblocks()
+#define FILEV6_RA_MIN 4       // read-ahead window (in sectors) once a sequential read is detected
+#define FILEV6_RA_MAX 128     // read-ahead window after it has doubled on each sequential read
+
 struct filev6 {
     struct unix_filesystem *u;    // the filesystem
     uint16_t i_number;            // the inode number (on disk)
     struct inode i_node;          // the content of the inode
     int32_t offset;               // the current cursor within the file (in bytes)
+    int32_t ra_next;              // sector of the file a sequential read would start at
+    int32_t ra_end;               // first sector of the file not read ahead yet
+    uint32_t ra_window;           // current read-ahead window (in sectors), 0 for none
 };
 
 /* *************************************************** *
@@ -57,6 +64,22 @@ int filev6_lseek(struct filev6 *fv6, int32_t offset);
  */
 int filev6_readblock(struct filev6 *fv6, void *buf);
 
+/**
+ * @brief read at most nb_sectors*SECTOR_SIZE bytes from the file at the current cursor.
+ *        The data sectors are resolved first and then fetched with one I/O per
+ *        contiguous run on disk. At most FILEV6_READ_BATCH sectors are read per call.
+ *        Reads that continue the previous one grow a read-ahead window (up to
+ *        FILEV6_RA_MAX sectors), which is prefetched in one batch (see
+ *        fs_sector_prefetch(): into the sector cache, or into the pages of a
+ *        mapped image); any other read halves it.
+ * @param fv6 the filev6 (IN-OUT; offset will be changed)
+ * @param buf points to nb_sectors*SECTOR_SIZE bytes of available memory (OUT)
+ * @param nb_sectors the maximum number of sectors to read
+ * @return >0: the number of bytes of the file read; 0: end of file;
+ *             the appropriate error code (<0) on error
+ */
+int filev6_readblocks(struct filev6 *fv6, void *buf, size_t nb_sectors);
+
 /* *************************************************** *
  * TODO WEEK 1										   *
  * *************************************************** */
@@ -10,6 +10,9 @@
 #define SMALL_FILE_SECTOR_NBR 8
 #define MAX_FILE_SIZE 7*256*SECTOR_SIZE
 
+// where this thread allocates in the inode bitmap it last used, see bm_cursor_of()
+static _Thread_local struct bm_cursor inode_cursor = { NULL, BM_CURSOR_UNSET };
+
 /**
  * @brief read all inodes from disk and print out their content to
  *        stdout according to the assignment
@@ -66,24 +69,37 @@ int inode_read(const struct unix_filesystem *u, uint16_t inr, struct inode *inod
     if (inr >= INODES_PER_SECTOR*sizeInode || inr <= INODE_ID_START) 
         return ERR_INODE_OUT_OF_RANGE;
 
-    struct inode x[INODES_PER_SECTOR];
     uint32_t sectorToRead = inr/INODES_PER_SECTOR;
 
-    int sectorReadCheck = sector_read(u->f, inodeStart + sectorToRead, x);
+    // on a mapped image, only the requested inode is copied
+    const struct inode_sector *mapped = fs_sector_map(u, inodeStart + sectorToRead, 1);
 
-    if (sectorReadCheck != ERR_NONE) 
-        return sectorReadCheck;
+    if (mapped != NULL) {
+
+        *inode = mapped->inodes[inr % INODES_PER_SECTOR];
+
+    } else {
+
+        struct inode x[INODES_PER_SECTOR];
 
-    memcpy(inode, &(x[inr - sectorToRead*INODES_PER_SECTOR]), sizeof(struct inode));
+        int sectorReadCheck = fs_sector_read(u, inodeStart + sectorToRead, x);
+
+        if (sectorReadCheck != ERR_NONE) 
+            return sectorReadCheck;
+
+        memcpy(inode, &(x[inr - sectorToRead*INODES_PER_SECTOR]), sizeof(struct inode));
+
+    }
 
     return (inode->i_mode & IALLOC) ? ERR_NONE : ERR_UNALLOCATED_INODE;
     
 }
 
-int inode_findsector(const struct unix_filesystem *u, const struct inode *i, int32_t file_sec_off) {
-    
-    M_REQUIRE_NON_NULL(u);
-    M_REQUIRE_NON_NULL(i);
+/**
+ * @brief check that the count portions of a file from file_sec_off exist
+ * @return 0 if they do; <0 error
+ */
+static int inode_check_sectors(const struct inode *i, int32_t file_sec_off, size_t count) {
 
     if (!(i->i_mode & IALLOC))
         return ERR_UNALLOCATED_INODE;
@@ -93,21 +109,102 @@ int inode_findsector(const struct unix_filesystem *u, const struct inode *i, int
     if (inodeSize > MAX_FILE_SIZE)
         return ERR_FILE_TOO_LARGE;
 
-    if (file_sec_off < 0 || file_sec_off > inodeSize/SECTOR_SIZE)
+    int32_t nbSectors = (inodeSize + SECTOR_SIZE - 1)/SECTOR_SIZE;
+
+    if (file_sec_off < 0 || file_sec_off >= nbSectors || count > (size_t) (nbSectors - file_sec_off))
         return ERR_OFFSET_OUT_OF_RANGE;
 
-    if (SMALL_FILE_SECTOR_NBR*SECTOR_SIZE > inodeSize)
+    return ERR_NONE;
+
+}
+
+int inode_findsector(const struct unix_filesystem *u, const struct inode *i, int32_t file_sec_off) {
+    
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(i);
+
+    int sectorsCheck = inode_check_sectors(i, file_sec_off, 1);
+
+    if (sectorsCheck != ERR_NONE)
+        return sectorsCheck;
+
+    if (inode_getsize(i) <= SMALL_FILE_SECTOR_NBR*SECTOR_SIZE)
         return i->i_addr[file_sec_off];
 
-    uint16_t data[SECTOR_SIZE];
-    int sectorReadCheck = sector_read(u->f, i->i_addr[inodeSize/(ADDRESSES_PER_SECTOR*SECTOR_SIZE)], data);
+    // large file: i_addr holds indirect sectors of ADDRESSES_PER_SECTOR addresses each
+    uint16_t indirect = i->i_addr[file_sec_off/ADDRESSES_PER_SECTOR];
+
+    const uint16_t *mapped = fs_sector_map(u, indirect, 1);
+    if (mapped != NULL)
+        return mapped[file_sec_off % ADDRESSES_PER_SECTOR];
+
+    uint16_t data[ADDRESSES_PER_SECTOR];
+    int sectorReadCheck = fs_sector_read(u, indirect, data);
     if (sectorReadCheck != ERR_NONE)
         return sectorReadCheck;
 
-    return data[(SECTOR_SIZE/ADDRESSES_PER_SECTOR)*file_sec_off];
+    return data[file_sec_off % ADDRESSES_PER_SECTOR];
     
 }
 
+int inode_findsectors(const struct unix_filesystem *u, const struct inode *i, int32_t first_sec_off, size_t count,
+                      uint32_t *sectors) {
+
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(i);
+    M_REQUIRE_NON_NULL(sectors);
+
+    if (count == 0)
+        return ERR_NONE;
+
+    int sectorsCheck = inode_check_sectors(i, first_sec_off, count);
+
+    if (sectorsCheck != ERR_NONE)
+        return sectorsCheck;
+
+    if (inode_getsize(i) <= SMALL_FILE_SECTOR_NBR*SECTOR_SIZE) {
+
+        for (size_t k = 0; k < count; k++)
+            sectors[k] = i->i_addr[first_sec_off + (int32_t) k];
+
+        return ERR_NONE;
+
+    }
+
+    // the indirect sector holding the current offset, read when the offset enters it
+    const uint16_t *addresses = NULL;
+    uint16_t data[ADDRESSES_PER_SECTOR];
+
+    for (size_t k = 0; k < count; k++) {
+
+        int32_t off = first_sec_off + (int32_t) k;
+
+        if (addresses == NULL || off % ADDRESSES_PER_SECTOR == 0) {
+
+            uint16_t indirect = i->i_addr[off/ADDRESSES_PER_SECTOR];
+
+            addresses = fs_sector_map(u, indirect, 1);
+
+            if (addresses == NULL) {
+
+                int sectorReadCheck = fs_sector_read(u, indirect, data);
+                if (sectorReadCheck != ERR_NONE)
+                    return sectorReadCheck;
+
+                addresses = data;
+
+            }
+
+        }
+
+        sectors[k] = addresses[off % ADDRESSES_PER_SECTOR];
+
+    }
+
+    return ERR_NONE;
+
+}
+
 /**
  * @brief write the content of an inode to disk
  * @param u the filesystem (IN)
@@ -154,14 +251,14 @@ int inode_write(struct unix_filesystem *u, uint16_t inr, const struct inode *ino
 
     char sector[SECTOR_SIZE];
 
-    int sectorReadCheck = sector_read(u->f, findSectorCheck, sector);
+    int sectorReadCheck = fs_sector_read(u, findSectorCheck, sector);
 
     if (sectorReadCheck != ERR_NONE)
         return sectorReadCheck;
 
     memcpy(&(sector[inr - INODES_PER_SECTOR*findSectorCheck]), inode, sizeof(struct inode));
 
-    int sectorWriteCheck = sector_write(u->f, findSectorCheck, sector);
+    int sectorWriteCheck = fs_sector_write(u, findSectorCheck, sector);
 
     if (sectorWriteCheck != ERR_NONE)
         return sectorWriteCheck;
@@ -179,13 +276,23 @@ int inode_alloc(struct unix_filesystem *u) {
 
     M_REQUIRE_NON_NULL(u);
 
-    int inr = bm_find_next(u->ibm);
+    // lazily mounted filesystems build their bitmaps on the first allocation
+    int bitmapsCheck = mountv6_bitmaps(u);
+
+    if (bitmapsCheck != ERR_NONE)
+        return bitmapsCheck;
+
+    int modifiedCheck = mountv6_modified(u);
+
+    if (modifiedCheck != ERR_NONE)
+        return modifiedCheck;
+
+    // without a lock: concurrent allocations claim different bits
+    int inr = bm_claim_next(u->ibm, bm_cursor_of(&inode_cursor, u->ibm));
 
     if (inr < ERR_NONE)
         return ERR_BITMAP_FULL;
 
-    bm_set(u->ibm, inr);
-
     return inr;
 
 }
@@ -93,11 +93,25 @@ int inode_read(const struct unix_filesystem *u, uint16_t inr, struct inode *inod
  */
 int inode_findsector(const struct unix_filesystem *u, const struct inode *i, int32_t file_sec_off);
 
+/**
+ * @brief identify the sectors of count consecutive portions of a file, as
+ *        inode_findsector() does for each, but reading each indirect sector once
+ * @param u the filesystem (IN)
+ * @param inode the inode (IN)
+ * @param first_sec_off the offset of the first portion (in sector-size units)
+ * @param count the number of portions
+ * @param sectors the sectors on disk, count of them (OUT)
+ * @return 0 on success; <0 on error
+ */
+int inode_findsectors(const struct unix_filesystem *u, const struct inode *i, int32_t first_sec_off, size_t count,
+                      uint32_t *sectors);
+
 /* *************************************************** *
  * TODO WEEK 11										   *
  * *************************************************** */
 /**
- * @brief alloc a new inode (returns its inr if possible)
+ * @brief alloc a new inode (returns its inr if possible); several threads can
+ *        allocate at once, once the bitmaps are built (see mountv6_bitmaps())
  * @param u the filesystem (IN)
  * @return the inode number of the new inode or error code on error
  */
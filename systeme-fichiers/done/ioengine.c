@@ -0,0 +1,574 @@
+/**
+ * @file ioengine.c
+ * @brief asynchronous sector reads on io_uring, with a pread() thread-pool fallback
+ *
+ * io_uring is driven through its raw system calls, so that no extra
+ * library is needed; when the kernel (or a sandbox) refuses
+ * io_uring_setup(), the engine silently switches to threads.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>       // nanosleep()
+#include <sys/uio.h>    // struct iovec
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "ioengine.h"
+#include "error.h"
+#include "unixv6fs.h"
+
+// build with -DIOENGINE_NO_URING to always use the thread pool
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(__has_include) && !defined(IOENGINE_NO_URING)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define IOENGINE_HAS_URING 1
+#endif
+#endif
+
+#define IOENGINE_POLL_NS 100000 // between two looks at the completion queue of a ring that cannot be waited on
+
+struct ioengine_request {
+    int fd;
+    uint32_t sector;
+    uint32_t count;
+    void *data;
+    uint64_t tag;
+    int result;
+    struct iovec iov;           // io_uring only
+};
+
+#ifdef IOENGINE_HAS_URING
+struct ioengine_uring {
+    int ring_fd;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+#endif
+
+struct ioengine {
+    int fd;
+    unsigned depth;
+    unsigned pending;           // submitted and not returned by ioengine_wait()
+    struct ioengine_request *slots;
+    uint8_t *slot_used;
+    int use_uring;
+#ifdef IOENGINE_HAS_URING
+    struct ioengine_uring ring;
+#endif
+    // thread pool: slots move from the submission queue to the completion queue
+    pthread_t threads[IOENGINE_NB_THREADS];
+    unsigned nb_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t submitted;
+    pthread_cond_t completed;
+    unsigned *sq;               // ring of slot indexes waiting for a worker
+    unsigned sq_first, sq_count;
+    unsigned *cq;               // ring of completed slot indexes
+    unsigned cq_first, cq_count;
+    int stopping;
+};
+
+/**
+ * @brief synchronous read of one request, used by the workers
+ */
+static int ioengine_pread(const struct ioengine_request *r) {
+
+    uint8_t *dst = r->data;
+    size_t left = (size_t) r->count * SECTOR_SIZE;
+    off_t offset = (off_t) r->sector * SECTOR_SIZE;
+
+    while (left > 0) {
+
+        ssize_t nb_read = pread(r->fd, dst, left, offset);
+
+        if (nb_read < 0 && errno == EINTR)
+            continue;
+
+        if (nb_read <= 0)
+            return ERR_IO;
+
+        dst += nb_read;
+        left -= (size_t) nb_read;
+        offset += nb_read;
+
+    }
+
+    return ERR_NONE;
+
+}
+
+/*
+ * thread-pool fallback
+ */
+
+static void *ioengine_worker(void *arg) {
+
+    struct ioengine *e = arg;
+
+    pthread_mutex_lock(&(e->lock));
+
+    while (1) {
+
+        while (e->sq_count == 0 && !e->stopping)
+            pthread_cond_wait(&(e->submitted), &(e->lock));
+
+        if (e->sq_count == 0)
+            break;
+
+        unsigned slot = e->sq[e->sq_first];
+        e->sq_first = (e->sq_first + 1) % e->depth;
+        e->sq_count--;
+
+        pthread_mutex_unlock(&(e->lock));
+        int result = ioengine_pread(&(e->slots[slot]));
+        pthread_mutex_lock(&(e->lock));
+
+        e->slots[slot].result = result;
+        e->cq[(e->cq_first + e->cq_count) % e->depth] = slot;
+        e->cq_count++;
+        pthread_cond_signal(&(e->completed));
+
+    }
+
+    pthread_mutex_unlock(&(e->lock));
+
+    return NULL;
+
+}
+
+/**
+ * @brief initialize the lock and the conditions of the thread pool
+ * @return 0 on success (all of them are); ERR_NOMEM otherwise (none is)
+ */
+static int ioengine_threads_init(struct ioengine *e) {
+
+    if (pthread_mutex_init(&(e->lock), NULL) != 0)
+        return ERR_NOMEM;
+
+    if (pthread_cond_init(&(e->submitted), NULL) != 0) {
+        pthread_mutex_destroy(&(e->lock));
+        return ERR_NOMEM;
+    }
+
+    if (pthread_cond_init(&(e->completed), NULL) != 0) {
+        pthread_cond_destroy(&(e->submitted));
+        pthread_mutex_destroy(&(e->lock));
+        return ERR_NOMEM;
+    }
+
+    return ERR_NONE;
+
+}
+
+static int ioengine_threads_start(struct ioengine *e) {
+
+    e->sq = calloc(e->depth, sizeof(unsigned));
+    e->cq = calloc(e->depth, sizeof(unsigned));
+
+    if (e->sq == NULL || e->cq == NULL)
+        return ERR_NOMEM;
+
+    for (unsigned i = 0; i < IOENGINE_NB_THREADS; i++) {
+
+        if (pthread_create(&(e->threads[i]), NULL, ioengine_worker, e) != 0)
+            break;
+
+        e->nb_threads++;
+
+    }
+
+    return (e->nb_threads > 0) ? ERR_NONE : ERR_NOMEM;
+
+}
+
+static void ioengine_threads_stop(struct ioengine *e) {
+
+    pthread_mutex_lock(&(e->lock));
+    e->stopping = 1;
+    pthread_cond_broadcast(&(e->submitted));
+    pthread_mutex_unlock(&(e->lock));
+
+    for (unsigned i = 0; i < e->nb_threads; i++)
+        pthread_join(e->threads[i], NULL);
+
+    free(e->sq);
+    free(e->cq);
+
+}
+
+/*
+ * io_uring
+ */
+
+#ifdef IOENGINE_HAS_URING
+static int ioengine_uring_setup(struct ioengine *e) {
+
+    struct ioengine_uring *r = &(e->ring);
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+
+    long fd = syscall(__NR_io_uring_setup, e->depth, &p);
+
+    if (fd < 0)
+        return ERR_IO;
+
+    r->ring_fd = (int) fd;
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size)
+            r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      r->ring_fd, IORING_OFF_SQ_RING);
+
+    if (r->sq_ring == MAP_FAILED) {
+        close(r->ring_fd);
+        return ERR_IO;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          r->ring_fd, IORING_OFF_CQ_RING);
+    }
+
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->ring_fd, IORING_OFF_SQES);
+
+    if (r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+
+        if (r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring)
+            munmap(r->cq_ring, r->cq_ring_size);
+        munmap(r->sq_ring, r->sq_ring_size);
+        close(r->ring_fd);
+
+        return ERR_IO;
+
+    }
+
+    uint8_t *sq = r->sq_ring;
+    uint8_t *cq = r->cq_ring;
+
+    r->sq_head = (unsigned *) (void *) (sq + p.sq_off.head);
+    r->sq_tail = (unsigned *) (void *) (sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (void *) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (void *) (sq + p.sq_off.array);
+    r->cq_head = (unsigned *) (void *) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned *) (void *) (cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (void *) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (void *) (cq + p.cq_off.cqes);
+
+    return ERR_NONE;
+
+}
+
+static void ioengine_uring_release(struct ioengine *e) {
+
+    struct ioengine_uring *r = &(e->ring);
+
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_size);
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->ring_fd);
+
+}
+
+static int ioengine_uring_submit(struct ioengine *e, unsigned slot) {
+
+    struct ioengine_uring *r = &(e->ring);
+    struct ioengine_request *req = &(e->slots[slot]);
+
+    unsigned tail = *(r->sq_tail);
+    unsigned index = tail & *(r->sq_mask);
+    struct io_uring_sqe *sqe = &(r->sqes[index]);
+
+    req->iov.iov_base = req->data;
+    req->iov.iov_len = (size_t) req->count * SECTOR_SIZE;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = req->fd;
+    sqe->addr = (uint64_t) (uintptr_t) &(req->iov);
+    sqe->len = 1;
+    sqe->off = (uint64_t) req->sector * SECTOR_SIZE;
+    sqe->user_data = slot;
+
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while (1) {
+
+        long submitted = syscall(__NR_io_uring_enter, r->ring_fd, 1, 0, 0, NULL, 0);
+
+        if (submitted == 1)
+            return ERR_NONE;
+
+        if (submitted < 0 && errno == EINTR)
+            continue;
+
+        break;
+
+    }
+
+    // consumed anyway: it completes like any other
+    if (__atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) != tail)
+        return ERR_NONE;
+
+    // otherwise, take it back, so that no SQE is left in the ring without a slot
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    return ERR_IO;
+
+}
+
+/**
+ * @brief the slot of the next completion, waiting for it if needed. If the ring
+ *        cannot be waited on, its completion queue is polled instead: the kernel
+ *        still owns the buffers in flight, so no slot is given back before its
+ *        own completion (task work runs on the return of any system call, e.g.
+ *        nanosleep(), so the completions keep coming)
+ * @return the slot
+ */
+static unsigned ioengine_uring_reap(struct ioengine *e) {
+
+    struct ioengine_uring *r = &(e->ring);
+    int polling = 0;
+
+    while (1) {
+
+        unsigned head = *(r->cq_head);
+
+        if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+
+            const struct io_uring_cqe *cqe = &(r->cqes[head & *(r->cq_mask)]);
+            unsigned slot = (unsigned) cqe->user_data;
+            struct ioengine_request *req = &(e->slots[slot]);
+
+            req->result = (cqe->res == (int) req->iov.iov_len) ? ERR_NONE : ERR_IO;
+            __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+
+            return slot;
+
+        }
+
+        if (polling) {
+
+            const struct timespec pause = { .tv_sec = 0, .tv_nsec = IOENGINE_POLL_NS };
+            nanosleep(&pause, NULL);
+            continue;
+
+        }
+
+        long entered = syscall(__NR_io_uring_enter, r->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+
+        // EAGAIN, EBUSY: the completions above have to be reaped first
+        if (entered < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            polling = 1;
+
+    }
+
+}
+#endif
+
+/*
+ * public API
+ */
+
+struct ioengine *ioengine_open(int fd, unsigned depth) {
+
+    if (fd < 0 || depth == 0)
+        return NULL;
+
+    struct ioengine *e = calloc(1, sizeof(struct ioengine));
+
+    if (e == NULL)
+        return NULL;
+
+    e->fd = fd;
+    e->depth = depth;
+    e->slots = calloc(depth, sizeof(struct ioengine_request));
+    e->slot_used = calloc(depth, sizeof(uint8_t));
+
+    if (e->slots == NULL || e->slot_used == NULL) {
+        free(e->slots);
+        free(e->slot_used);
+        free(e);
+        return NULL;
+    }
+
+#ifdef IOENGINE_HAS_URING
+    e->use_uring = (ioengine_uring_setup(e) == ERR_NONE);
+#endif
+
+    if (!e->use_uring) {
+
+        if (ioengine_threads_init(e) != ERR_NONE) {
+            free(e->slots);
+            free(e->slot_used);
+            free(e);
+            return NULL;
+        }
+
+        if (ioengine_threads_start(e) != ERR_NONE) {
+            ioengine_close(e);
+            return NULL;
+        }
+
+    }
+
+    return e;
+
+}
+
+void ioengine_close(struct ioengine *e) {
+
+    if (e == NULL)
+        return;
+
+    uint64_t tag;
+
+    while (e->pending > 0)
+        ioengine_wait(e, &tag);
+
+#ifdef IOENGINE_HAS_URING
+    if (e->use_uring)
+        ioengine_uring_release(e);
+#endif
+
+    if (!e->use_uring) {
+        ioengine_threads_stop(e);
+        pthread_cond_destroy(&(e->completed));
+        pthread_cond_destroy(&(e->submitted));
+        pthread_mutex_destroy(&(e->lock));
+    }
+
+    free(e->slots);
+    free(e->slot_used);
+    free(e);
+
+}
+
+int ioengine_submit_read(struct ioengine *e, uint32_t sector, uint32_t count, void *data, uint64_t tag) {
+
+    M_REQUIRE_NON_NULL(e);
+    M_REQUIRE_NON_NULL(data);
+
+    if (e->pending >= e->depth || count == 0)
+        return ERR_BAD_PARAMETER;
+
+    unsigned slot = 0;
+
+    while (e->slot_used[slot])
+        slot++;
+
+    struct ioengine_request *req = &(e->slots[slot]);
+
+    req->fd = e->fd;
+    req->sector = sector;
+    req->count = count;
+    req->data = data;
+    req->tag = tag;
+    req->result = ERR_NONE;
+
+#ifdef IOENGINE_HAS_URING
+    if (e->use_uring) {
+
+        int submitCheck = ioengine_uring_submit(e, slot);
+
+        if (submitCheck != ERR_NONE)
+            return submitCheck;
+
+        e->slot_used[slot] = 1;
+        e->pending++;
+
+        return ERR_NONE;
+
+    }
+#endif
+
+    e->slot_used[slot] = 1;
+    e->pending++;
+
+    pthread_mutex_lock(&(e->lock));
+    e->sq[(e->sq_first + e->sq_count) % e->depth] = slot;
+    e->sq_count++;
+    pthread_cond_signal(&(e->submitted));
+    pthread_mutex_unlock(&(e->lock));
+
+    return ERR_NONE;
+
+}
+
+int ioengine_wait(struct ioengine *e, uint64_t *tag) {
+
+    M_REQUIRE_NON_NULL(e);
+    M_REQUIRE_NON_NULL(tag);
+
+    if (e->pending == 0)
+        return ERR_BAD_PARAMETER;
+
+    unsigned slot = 0;
+
+#ifdef IOENGINE_HAS_URING
+    if (e->use_uring) {
+
+        slot = ioengine_uring_reap(e);
+
+    } else
+#endif
+    {
+        pthread_mutex_lock(&(e->lock));
+
+        while (e->cq_count == 0)
+            pthread_cond_wait(&(e->completed), &(e->lock));
+
+        slot = e->cq[e->cq_first];
+        e->cq_first = (e->cq_first + 1) % e->depth;
+        e->cq_count--;
+
+        pthread_mutex_unlock(&(e->lock));
+    }
+
+    e->slot_used[slot] = 0;
+    e->pending--;
+    *tag = e->slots[slot].tag;
+
+    return e->slots[slot].result;
+
+}
+
+unsigned ioengine_pending(const struct ioengine *e) {
+
+    return (e == NULL) ? 0 : e->pending;
+
+}
+
+unsigned ioengine_depth(const struct ioengine *e) {
+
+    return (e == NULL) ? 0 : e->depth;
+
+}
+
+const char *ioengine_name(const struct ioengine *e) {
+
+    return (e != NULL && e->use_uring) ? "io_uring" : "threads";
+
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+/**
+ * @file ioengine.h
+ * @brief asynchronous sector reads: submit many, then wait for completions
+ *
+ * The engine reads sectors from a file descriptor with io_uring when the
+ * kernel offers it, and otherwise with a small pool of threads doing
+ * pread(). Both behave the same way for the caller: at most
+ * ioengine_depth() reads are in flight and each one completes exactly
+ * once, in any order, with the tag it was submitted with.
+ * A mounted filesystem opens one for the prefetches of its sector cache,
+ * i.e. on the stdio and pread backends (pread is the u6fs default); a
+ * mapped image is read ahead by the kernel instead (see blockdev_willneed()).
+ */
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IOENGINE_DEFAULT_DEPTH 32   // reads in flight
+#define IOENGINE_NB_THREADS 4       // workers of the thread-pool fallback
+
+struct ioengine;
+
+/**
+ * @brief create an engine reading from fd
+ * @param fd the open disk image (must outlive the engine)
+ * @param depth the maximum number of reads in flight (>0)
+ * @return the new engine; NULL on failure
+ */
+struct ioengine *ioengine_open(int fd, unsigned depth);
+
+/**
+ * @brief wait for the pending reads and release the engine
+ * @param e the engine (may be NULL)
+ */
+void ioengine_close(struct ioengine *e);
+
+/**
+ * @brief queue the read of count contiguous sectors; it is started at once
+ * @param e the engine
+ * @param sector the first sector
+ * @param count the number of sectors
+ * @param data a pointer to count*512 bytes of memory, which must stay valid
+ *        until the read completes (OUT)
+ * @param tag a value returned by ioengine_wait() with the completion
+ * @return 0 on success; ERR_BAD_PARAMETER if depth reads are already in flight;
+ *         <0 on error
+ */
+int ioengine_submit_read(struct ioengine *e, uint32_t sector, uint32_t count, void *data, uint64_t tag);
+
+/**
+ * @brief wait for one read to complete; once it returns, the engine (and the
+ *        kernel) no longer use the buffer of that read
+ * @param e the engine
+ * @param tag the tag of the completed read (OUT)
+ * @return the result of the read: 0 on success, <0 on error;
+ *         ERR_BAD_PARAMETER if no read is in flight
+ */
+int ioengine_wait(struct ioengine *e, uint64_t *tag);
+
+/**
+ * @brief the number of reads submitted and not yet returned by ioengine_wait()
+ */
+unsigned ioengine_pending(const struct ioengine *e);
+
+/**
+ * @brief the maximum number of reads in flight
+ */
+unsigned ioengine_depth(const struct ioengine *e);
+
+/**
+ * @brief the implementation in use: "io_uring" or "threads"
+ */
+const char *ioengine_name(const struct ioengine *e);
+
+#ifdef __cplusplus
+}
+#endif
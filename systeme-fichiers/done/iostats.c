@@ -0,0 +1,111 @@
+/**
+ * @file iostats.c
+ * @brief counters and latency histograms of the I/O reaching a disk image
+ */
+
+#include <time.h>     // clock_gettime()
+#include <inttypes.h>
+#include "iostats.h"
+#include "error.h"
+#include "unixv6fs.h"
+
+static const char *const IOSTATS_OP_NAMES[IOSTATS_NB_OPS] = {
+    [IOSTATS_READ]  = "reads",
+    [IOSTATS_WRITE] = "writes",
+};
+
+uint64_t iostats_now(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * UINT64_C(1000000000) + (uint64_t) ts.tv_nsec;
+
+}
+
+/**
+ * @brief the histogram bucket of a latency: floor(log2(ns)), clamped
+ */
+static unsigned iostats_bucket(uint64_t ns) {
+
+    unsigned bucket = 0;
+
+    while (ns > 1 && bucket < IOSTATS_NB_BUCKETS - 1) {
+        ns >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+
+}
+
+void iostats_record(struct iostats *s, enum iostats_op op, uint32_t sector, uint32_t count, uint64_t ns) {
+
+    if (s == NULL || op >= IOSTATS_NB_OPS)
+        return;
+
+    struct iostats_counters *c = &(s->ops[op]);
+    uint32_t previous = (uint32_t) atomic_exchange_explicit(&(s->next_sector), sector + count, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&(c->requests), 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&(c->sectors), count, memory_order_relaxed);
+    atomic_fetch_add_explicit(&(c->total_ns), ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&(c->histogram[iostats_bucket(ns)]), 1, memory_order_relaxed);
+
+    if (sector == previous)
+        atomic_fetch_add_explicit(&(c->sequential), 1, memory_order_relaxed);
+    else
+        atomic_fetch_add_explicit(&(c->seek_distance), (sector > previous) ? sector - previous : previous - sector,
+                                  memory_order_relaxed);
+
+    uint_fast64_t max = atomic_load_explicit(&(c->max_ns), memory_order_relaxed);
+
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&(c->max_ns), &max, ns,
+                                                             memory_order_relaxed, memory_order_relaxed));
+
+}
+
+void iostats_print(const struct iostats *s) {
+
+    if (s == NULL)
+        return;
+
+    pps_printf("**********I/O STATISTICS START**********\n");
+
+    for (int op = 0; op < IOSTATS_NB_OPS; op++) {
+
+        const struct iostats_counters *c = &(s->ops[op]);
+        uint64_t requests = c->requests;
+
+        pps_printf("%-20s: %" PRIu64 "\n", IOSTATS_OP_NAMES[op], requests);
+
+        if (requests == 0)
+            continue;
+
+        uint64_t sectors = c->sectors;
+        uint64_t sequential = c->sequential;
+
+        pps_printf("%-20s: %" PRIu64 "\n", "  sectors", sectors);
+        pps_printf("%-20s: %" PRIu64 "\n", "  bytes", sectors * SECTOR_SIZE);
+        pps_printf("%-20s: %" PRIu64 "\n", "  sequential", sequential);
+        pps_printf("%-20s: %" PRIu64 "\n", "  random (seeks)", requests - sequential);
+        pps_printf("%-20s: %" PRIu64 " sectors\n", "  seek distance", (uint64_t) c->seek_distance);
+        pps_printf("%-20s: %" PRIu64 " ns\n", "  mean latency", (uint64_t) c->total_ns / requests);
+        pps_printf("%-20s: %" PRIu64 " ns\n", "  max latency", (uint64_t) c->max_ns);
+
+        for (unsigned k = 0; k < IOSTATS_NB_BUCKETS; k++) {
+
+            uint64_t nb = c->histogram[k];
+
+            if (nb > 0)
+                pps_printf("  [%10" PRIu64 ", %10" PRIu64 ") ns: %" PRIu64 "\n",
+                           (k == 0) ? 0 : UINT64_C(1) << k, UINT64_C(1) << (k + 1), nb);
+
+        }
+
+    }
+
+    pps_printf("**********I/O STATISTICS END************\n");
+
+}
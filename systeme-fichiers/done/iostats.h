@@ -0,0 +1,74 @@
+#pragma once
+
+/**
+ * @file iostats.h
+ * @brief counters and latency histograms of the I/O reaching a disk image
+ *
+ * Every request that a block device serves is recorded with its first
+ * sector, its length and how long it took. An access is sequential when
+ * it starts right where the previous one (of any kind) ended, and is a
+ * seek otherwise. Latencies go into log2-sized buckets: bucket k counts
+ * the requests that took [2^k, 2^(k+1)) nanoseconds.
+ * The sectors read in place on an in-memory device (see fs_sector_map()) are
+ * recorded as reads too, in bucket 0: their latency is that of the page
+ * faults of the reader, which no request measures.
+ *
+ * The counters are atomic, so that concurrent threads can record without
+ * a lock; a zero-filled struct iostats is ready to use.
+ */
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IOSTATS_NB_BUCKETS 32 // up to 2^32 ns, i.e. about 4 s
+
+enum iostats_op {
+    IOSTATS_READ,
+    IOSTATS_WRITE,
+    IOSTATS_NB_OPS
+};
+
+struct iostats_counters {
+    atomic_uint_fast64_t requests;      // device requests
+    atomic_uint_fast64_t sectors;       // sectors transferred
+    atomic_uint_fast64_t sequential;    // requests starting where the previous one ended
+    atomic_uint_fast64_t seek_distance; // sum of the distances (in sectors) of the other ones
+    atomic_uint_fast64_t total_ns;      // sum of the latencies
+    atomic_uint_fast64_t max_ns;        // longest request
+    atomic_uint_fast64_t histogram[IOSTATS_NB_BUCKETS];
+};
+
+struct iostats {
+    struct iostats_counters ops[IOSTATS_NB_OPS];
+    atomic_uint_fast32_t next_sector;   // sector following the last request
+};
+
+/**
+ * @brief the current time of a monotonic clock, to measure latencies
+ * @return the time in nanoseconds
+ */
+uint64_t iostats_now(void);
+
+/**
+ * @brief record a completed request
+ * @param s the statistics
+ * @param op the kind of request
+ * @param sector the first sector of the request
+ * @param count the number of sectors of the request
+ * @param ns how long the request took
+ */
+void iostats_record(struct iostats *s, enum iostats_op op, uint32_t sector, uint32_t count, uint64_t ns);
+
+/**
+ * @brief print the counters and the non-empty latency buckets to stdout
+ * @param s the statistics
+ */
+void iostats_print(const struct iostats *s);
+
+#ifdef __cplusplus
+}
+#endif
@@ -6,132 +6,810 @@
  * @date 2022
  */
 
-#include <string.h> // memset()
+#include <string.h> // memset(), strncpy()
 #include <stdlib.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h> // sysconf(), ftruncate()
+#include <fcntl.h>  // open()
+#include <sched.h>  // sched_yield()
 
 #include "error.h"
 #include "mount.h"
 #include "sector.h"
 #include "bmblock.h"
 #include "inode.h"
+#include "util.h"
+
+#define MOUNT_INODE_BATCH 64 // number of inode sectors (32 KiB) read at once when scanning the inode table
+#define MOUNT_INDIRECT_BATCH (MOUNT_INODE_BATCH * INODES_PER_SECTOR) // indirect sectors resolved at once
+#define MOUNT_SCAN_MAX_THREADS 8 // threads rebuilding the bitmaps of a large inode table
+
+static const char *const MOUNT_PHASE_NAMES[MOUNT_NB_PHASES] = {
+    [MOUNT_PHASE_BOOT]         = "boot sector",
+    [MOUNT_PHASE_SUPERBLOCK]   = "superblock",
+    [MOUNT_PHASE_INODE_BITMAP] = "inode bitmap",
+    [MOUNT_PHASE_BLOCK_BITMAP] = "block bitmap",
+    [MOUNT_PHASE_BLOCK_MAP]    = "block map",
+};
+
+/**
+ * @brief the current time if the mount is profiled, 0 otherwise, see mountv6_profile()
+ */
+static uint64_t mountv6_clock(const struct unix_filesystem *u) {
+
+    return u->profile.enabled ? iostats_now() : 0;
+
+}
+
+/**
+ * @brief charge a mount phase with the time elapsed since start, and the sectors it read
+ * @param u the filesystem (IN-OUT)
+ * @param phase the phase
+ * @param start the time the phase started, from mountv6_clock()
+ * @param sectors the number of sectors read by the phase
+ */
+static void mountv6_profile(struct unix_filesystem *u, enum mount_phase phase, uint64_t start, uint64_t sectors) {
+
+    if (!u->profile.enabled)
+        return;
+
+    u->profile.ns[phase] += iostats_now() - start;
+    u->profile.sectors[phase] += sectors;
+
+}
+
+/**
+ * @brief the number of bytes held by a bitmap and its header, as allocated by bm_alloc()
+ */
+static size_t mountv6_bitmap_bytes(const struct bmblock_array *bm) {
+
+    return sizeof(*bm) + (bm->length - 1 + BM_SUMMARY_LENGTH(bm->length)) * sizeof(uint64_t);
+
+}
+
+/**
+ * @brief record that the bitmaps hold the given number of bytes, if it is a new peak
+ */
+static void mountv6_profile_memory(struct unix_filesystem *u, size_t bytes) {
+
+    if (bytes > u->profile.bitmap_peak)
+        u->profile.bitmap_peak = bytes;
+
+}
+
+/**
+ * @brief mark the sectors of the large files of a batch of inodes in the block
+ *        bitmap, reading each of their indirect sectors once; up to
+ *        MOUNT_INDIRECT_BATCH indirect sectors are prefetched at a time, so
+ *        that their reads are in flight together
+ * @param u the filesystem (IN)
+ * @param fbm the block bitmap (IN-OUT)
+ * @param inodes the large files
+ * @param nbInodes the number of entries in inodes
+ * @param resolved the number of indirect sectors read so far (IN-OUT)
+ * @return 0 on success; <0 on error
+ */
+static int mountv6_mark_indirect(struct unix_filesystem *u, struct bmblock_array *fbm,
+                                 const struct inode *const *inodes, size_t nbInodes, uint64_t *resolved) {
+
+    size_t n = 0;
+    int32_t j = 0;
+
+    while (n < nbInodes) {
+
+        uint32_t indirect[MOUNT_INDIRECT_BATCH];
+        uint32_t nbAddresses[MOUNT_INDIRECT_BATCH];
+        size_t nbIndirect = 0;
+
+        // gather the next indirect sectors, resuming at the j-th one of the n-th file
+        while (n < nbInodes && nbIndirect < MOUNT_INDIRECT_BATCH) {
+
+            int32_t nbSectors = (inode_getsize(inodes[n]) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+            indirect[nbIndirect] = inodes[n]->i_addr[j];
+            nbAddresses[nbIndirect] = (uint32_t) MIN(nbSectors - j * ADDRESSES_PER_SECTOR, ADDRESSES_PER_SECTOR);
+            nbIndirect++;
+
+            if (++j * ADDRESSES_PER_SECTOR >= nbSectors) {
+                n++;
+                j = 0;
+            }
+
+        }
+
+        *resolved += nbIndirect;
+
+        int prefetchCheck = fs_sector_prefetch(u, indirect, nbIndirect);
+
+        if (prefetchCheck != ERR_NONE)
+            return prefetchCheck;
+
+        for (size_t k = 0; k < nbIndirect; k++) {
+
+            uint16_t buffer[ADDRESSES_PER_SECTOR];
+            const uint16_t *addresses = fs_sector_map(u, indirect[k], 1);
+
+            if (addresses == NULL) {
+
+                int readCheck = fs_sector_read(u, indirect[k], buffer);
+
+                if (readCheck != ERR_NONE)
+                    return readCheck;
+
+                addresses = buffer;
+
+            }
+
+            bm_set(fbm, indirect[k]);
+
+            for (uint32_t a = 0; a < nbAddresses[k]; a++)
+                bm_set(fbm, addresses[a]);
+
+        }
+
+    }
+
+    return ERR_NONE;
+
+}
+
+/**
+ * @brief a range of the inode table scanned by one thread, into its own bitmaps
+ */
+struct mountv6_scan {
+    struct unix_filesystem *u;
+    struct bmblock_array *ibm;
+    struct bmblock_array *fbm;
+    uint32_t first;     // first inode sector of the range (relative to s_inode_start)
+    uint32_t end;       // first inode sector after the range
+    int ret;            // result of the scan
+    uint64_t walk_ns;       // time spent reading and walking the inode sectors, when profiled
+    uint64_t map_ns;        // time spent in mountv6_mark_indirect(), when profiled
+    uint64_t walk_sectors;  // inode sectors walked
+    uint64_t map_sectors;   // indirect sectors read
+    pthread_t thread;
+};
+
+/**
+ * @brief mark the allocated inodes of a range of the inode table and their
+ *        sectors, reading MOUNT_INODE_BATCH inode sectors per I/O: the sectors
+ *        of small files are marked straight from the inode, and those of large
+ *        files with mountv6_mark_indirect()
+ * @param arg the struct mountv6_scan with the range and the bitmaps to fill (IN-OUT; its ret is set)
+ * @return NULL (thread entry point)
+ */
+static void *mountv6_scan_range(void *arg) {
+
+    struct mountv6_scan *scan = arg;
+    struct unix_filesystem *u = scan->u;
+    struct inode_sector *buffer = NULL;
+    int ret = ERR_NONE;
+
+    for (uint32_t first = scan->first; first < scan->end && ret == ERR_NONE; first += MOUNT_INODE_BATCH) {
+
+        uint32_t count = MIN((uint32_t) MOUNT_INODE_BATCH, scan->end - first);
+        uint64_t start = mountv6_clock(u);
+
+        // a mapped image is scanned in place
+        const struct inode_sector *batch = fs_sector_map(u, u->s.s_inode_start + first, count);
+
+        if (batch == NULL) {
+
+            if (buffer == NULL && (buffer = malloc(MOUNT_INODE_BATCH * sizeof(struct inode_sector))) == NULL) {
+                ret = ERR_NOMEM;
+                break;
+            }
+
+            ret = fs_sector_read_range(u, u->s.s_inode_start + first, count, buffer);
+            batch = buffer;
+
+        }
+
+        const struct inode *large[MOUNT_INDIRECT_BATCH];
+        size_t nbLarge = 0;
+
+        for (uint32_t i = 0; i < count * INODES_PER_SECTOR && ret == ERR_NONE; i++) {
+
+            uint16_t inr = (uint16_t) (first * INODES_PER_SECTOR + i);
+            const struct inode *inode = &(batch[i / INODES_PER_SECTOR].inodes[i % INODES_PER_SECTOR]);
+
+            if (inr == 0 || !(inode->i_mode & IALLOC))
+                continue;
+
+            bm_set(scan->ibm, inr);
+
+            int32_t size = inode_getsize(inode);
+
+            // the same limit as inode_findsector()
+            if (size > (ADDR_SMALL_LENGTH - 1) * ADDRESSES_PER_SECTOR * SECTOR_SIZE) {
+
+                ret = ERR_FILE_TOO_LARGE;
+
+            } else if (size > ADDR_SMALL_LENGTH * SECTOR_SIZE) {
+
+                large[nbLarge++] = inode;
+
+            } else {
+
+                for (int32_t j = 0; j * SECTOR_SIZE < size; j++)
+                    bm_set(scan->fbm, inode->i_addr[j]);
+
+            }
+
+        }
+
+        uint64_t mapStart = mountv6_clock(u);
+
+        if (ret == ERR_NONE && nbLarge > 0)
+            ret = mountv6_mark_indirect(u, scan->fbm, large, nbLarge, &(scan->map_sectors));
+
+        scan->walk_ns += mapStart - start;
+        scan->map_ns += mountv6_clock(u) - mapStart;
+        scan->walk_sectors += count;
+
+    }
+
+    free(buffer);
+    buffer = NULL;
+
+    scan->ret = ret;
+
+    return NULL;
+
+}
+
+/**
+ * @brief charge the inode table walk and the block map resolution of a rescan
+ *        with the time of the slowest thread and the sectors read by all of them
+ * @param u the filesystem (IN-OUT)
+ * @param scans the finished scans
+ * @param nbScans the number of entries in scans
+ */
+static void mountv6_profile_scans(struct unix_filesystem *u, const struct mountv6_scan *scans, uint32_t nbScans) {
+
+    if (!u->profile.enabled)
+        return;
+
+    uint64_t walkNs = 0, mapNs = 0;
+
+    for (uint32_t t = 0; t < nbScans; t++) {
+
+        walkNs = (scans[t].walk_ns > walkNs) ? scans[t].walk_ns : walkNs;
+        mapNs = (scans[t].map_ns > mapNs) ? scans[t].map_ns : mapNs;
+
+        u->profile.sectors[MOUNT_PHASE_INODE_BITMAP] += scans[t].walk_sectors;
+        u->profile.sectors[MOUNT_PHASE_BLOCK_MAP] += scans[t].map_sectors;
+
+    }
+
+    u->profile.ns[MOUNT_PHASE_INODE_BITMAP] += walkNs;
+    u->profile.ns[MOUNT_PHASE_BLOCK_MAP] += mapNs;
+
+}
+
+/**
+ * @brief OR the words of a partial bitmap into a bitmap with the same bounds
+ */
+static void mountv6_merge_bitmap(struct bmblock_array *bm, const struct bmblock_array *part) {
+
+    for (size_t i = 0; i < bm->length; i++)
+        bm->bm[i] |= part->bm[i];
+
+    bm_update_summary(bm);
+
+}
+
+/**
+ * @brief rebuild both bitmaps in a single pass over the inode table. Large
+ *        tables are split in ranges of whole batches, scanned in parallel by
+ *        up to one thread per core into private bitmaps, which are then merged
+ *        with a word-wide OR: the result is the same as a serial scan.
+ * @param u the filesystem (IN-OUT; ibm and fbm will be changed)
+ * @return 0 on success; <0 on error
+ */
+static int mountv6_scan_inodes(struct unix_filesystem *u) {
+
+    uint32_t nbBatches = (u->s.s_isize + MOUNT_INODE_BATCH - 1) / MOUNT_INODE_BATCH;
+    long nbCores = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t nbThreads = (uint32_t) MIN((long) MIN(nbBatches, MOUNT_SCAN_MAX_THREADS), (nbCores > 0) ? nbCores : 1);
+
+    if (nbThreads <= 1) {
+
+        struct mountv6_scan scan = { .u = u, .ibm = u->ibm, .fbm = u->fbm, .first = 0, .end = u->s.s_isize };
+
+        mountv6_scan_range(&scan);
+        mountv6_profile_scans(u, &scan, 1);
+
+        return scan.ret;
+
+    }
+
+    struct mountv6_scan scans[MOUNT_SCAN_MAX_THREADS];
+    uint32_t nbStarted = 0;
+    int ret = ERR_NONE;
+
+    for (uint32_t t = 0; t < nbThreads && ret == ERR_NONE; t++) {
+
+        struct mountv6_scan *scan = &(scans[t]);
+
+        scan->u = u;
+        scan->first = (nbBatches * t / nbThreads) * MOUNT_INODE_BATCH;
+        scan->end = MIN((nbBatches * (t + 1) / nbThreads) * MOUNT_INODE_BATCH, (uint32_t) u->s.s_isize);
+        scan->ret = ERR_NONE;
+        scan->walk_ns = scan->map_ns = scan->walk_sectors = scan->map_sectors = 0;
+        scan->ibm = bm_alloc(u->ibm->min, u->ibm->max);
+        scan->fbm = bm_alloc(u->fbm->min, u->fbm->max);
+
+        if (scan->ibm == NULL || scan->fbm == NULL) {
+
+            free(scan->ibm);
+            free(scan->fbm);
+            ret = ERR_NOMEM;
+            break;
+
+        }
+
+        if (pthread_create(&(scan->thread), NULL, mountv6_scan_range, scan) != 0) {
+
+            free(scan->ibm);
+            free(scan->fbm);
+            ret = ERR_IO;
+            break;
+
+        }
+
+        nbStarted++;
+
+    }
+
+    // every thread holds a copy of both bitmaps
+    mountv6_profile_memory(u, (1 + nbStarted) * (mountv6_bitmap_bytes(u->ibm) + mountv6_bitmap_bytes(u->fbm)));
+
+    for (uint32_t t = 0; t < nbStarted; t++) {
+
+        pthread_join(scans[t].thread, NULL);
+
+        if (ret == ERR_NONE)
+            ret = scans[t].ret;
+
+        uint64_t start = mountv6_clock(u);
+        mountv6_merge_bitmap(u->ibm, scans[t].ibm);
+        mountv6_profile(u, MOUNT_PHASE_INODE_BITMAP, start, 0);
+
+        start = mountv6_clock(u);
+        mountv6_merge_bitmap(u->fbm, scans[t].fbm);
+        mountv6_profile(u, MOUNT_PHASE_BLOCK_BITMAP, start, 0);
+
+        free(scans[t].ibm);
+        free(scans[t].fbm);
+
+    }
+
+    mountv6_profile_scans(u, scans, nbStarted);
+
+    return ret;
+
+}
+
+/**
+ * @brief load a bitmap from its on-disk sectors: bit i of the bitmap, i.e. the
+ *        state of element min+i, is bit i%8 of byte i/8
+ * @param u the filesystem (IN)
+ * @param bm the bitmap to fill (OUT)
+ * @param start the first sector of the on-disk bitmap
+ * @param size the number of sectors of the on-disk bitmap
+ * @param phase the mount phase charged with the read
+ * @return 0 on success; ERR_BITMAP_FULL if the on-disk bitmap is too small; <0 on error
+ */
+static int mountv6_read_bitmap(struct unix_filesystem *u, struct bmblock_array *bm, uint16_t start, uint16_t size,
+                               enum mount_phase phase) {
+
+    uint64_t begin = mountv6_clock(u);
+
+    // one bit per value, from min to max
+    if ((uint64_t) size * SECTOR_SIZE * 8 < bm->max - bm->min + 1)
+        return ERR_BITMAP_FULL;
+
+    uint32_t count = (uint32_t) MIN((uint64_t) size, (bm->length * sizeof(uint64_t) + SECTOR_SIZE - 1) / SECTOR_SIZE);
+    uint8_t *data = calloc(count, SECTOR_SIZE);
+
+    if (data == NULL)
+        return ERR_NOMEM;
+
+    int readCheck = fs_sector_read_range(u, start, count, data);
+
+    if (readCheck != ERR_NONE) {
+
+        free(data);
+        data = NULL;
+
+        return readCheck;
+
+    }
+
+    for (size_t i = 0; i < bm->length && i * sizeof(uint64_t) < (size_t) count * SECTOR_SIZE; i++) {
+
+        uint64_t word = 0;
+
+        for (size_t b = 0; b < sizeof(uint64_t); b++)
+            word |= (uint64_t) data[i * sizeof(uint64_t) + b] << (8 * b);
+
+        bm->bm[i] = word;
+
+    }
+
+    bm_update_summary(bm);
+
+    free(data);
+    data = NULL;
+
+    mountv6_profile(u, phase, begin, count);
+
+    return ERR_NONE;
+
+}
+
+/**
+ * @brief load both bitmaps from disk
+ * @param u the filesystem (IN-OUT; ibm and fbm are filled)
+ * @return 0 on success; ERR_BITMAP_FULL if the on-disk bitmaps cannot be used; <0 on error
+ */
+static int mountv6_load_bitmaps(struct unix_filesystem *u) {
+
+    int ibmCheck = mountv6_read_bitmap(u, u->ibm, u->s.s_ibm_start, u->s.s_ibmsize, MOUNT_PHASE_INODE_BITMAP);
+
+    if (ibmCheck != ERR_NONE)
+        return ibmCheck;
+
+    // the root directory always exists: an unmarked root means the bitmaps were never maintained
+    if (bm_get(u->ibm, ROOT_INUMBER) != 1)
+        return ERR_BITMAP_FULL;
+
+    return mountv6_read_bitmap(u, u->fbm, u->s.s_fbm_start, u->s.s_fbmsize, MOUNT_PHASE_BLOCK_BITMAP);
+
+}
 
 /**
- * @brief  mount a unix v6 filesystem
+ * @brief write a bitmap to its on-disk sectors, in the layout read by mountv6_read_bitmap()
+ * @param u the filesystem (IN)
+ * @param bm the bitmap to write (IN)
+ * @param start the first sector of the on-disk bitmap
+ * @param size the number of sectors of the on-disk bitmap
+ * @return 0 on success; <0 on error
+ */
+static int mountv6_write_bitmap(struct unix_filesystem *u, const struct bmblock_array *bm, uint16_t start, uint16_t size) {
+
+    uint32_t count = (uint32_t) MIN((uint64_t) size, (bm->length * sizeof(uint64_t) + SECTOR_SIZE - 1) / SECTOR_SIZE);
+    uint8_t *data = calloc(count, SECTOR_SIZE);
+
+    if (data == NULL)
+        return ERR_NOMEM;
+
+    for (size_t i = 0; i < bm->length && i * sizeof(uint64_t) < (size_t) count * SECTOR_SIZE; i++) {
+
+        for (size_t b = 0; b < sizeof(uint64_t); b++)
+            data[i * sizeof(uint64_t) + b] = (uint8_t) (bm->bm[i] >> (8 * b));
+
+    }
+
+    int ret = ERR_NONE;
+
+    for (uint32_t k = 0; k < count && ret == ERR_NONE; k++)
+        ret = fs_sector_write(u, start + k, data + (size_t) k * SECTOR_SIZE);
+
+    free(data);
+    data = NULL;
+
+    return ret;
+
+}
+
+/**
+ * @brief write the in-memory superblock to disk, and everything written
+ *        before it, so that its s_fmod flag is never ahead of the data
+ * @param u the filesystem (IN)
+ * @return 0 on success; <0 on error
+ */
+static int mountv6_sync_superblock(struct unix_filesystem *u) {
+
+    if (u->cache != NULL) {
+
+        int flushCheck = bcache_flush(u->cache);
+
+        if (flushCheck != ERR_NONE)
+            return flushCheck;
+
+    }
+
+    int writeCheck = fs_sector_write(u, SUPERBLOCK_SECTOR, &(u->s));
+
+    if (writeCheck != ERR_NONE || u->cache == NULL)
+        return writeCheck;
+
+    return bcache_flush(u->cache);
+
+}
+
+/**
+ * @brief check the boot sector and load the superblock of a filesystem whose
+ *        image is already opened (or mapped)
+ * @param u the filesystem (IN-OUT)
+ * @return 0 on success; <0 on error
+ */
+static int mountv6_load(struct unix_filesystem *u)
+{
+
+    // boot sector and superblock are contiguous: fetch both with one read
+    uint8_t x[2 * SECTOR_SIZE];
+    uint64_t start = mountv6_clock(u);
+
+    int headCheck = fs_sector_read_range(u, BOOTBLOCK_SECTOR, 2, x); 
+
+    if (headCheck != ERR_NONE)
+        return headCheck;
+
+    if (x[BOOTBLOCK_MAGIC_NUM_OFFSET] != BOOTBLOCK_MAGIC_NUM)
+        return ERR_BAD_BOOT_SECTOR;
+
+    // the shared read is charged to the boot sector check
+    mountv6_profile(u, MOUNT_PHASE_BOOT, start, 2);
+
+    start = mountv6_clock(u);
+    memcpy(&(u->s), x + (SUPERBLOCK_SECTOR - BOOTBLOCK_SECTOR) * SECTOR_SIZE, sizeof(u->s));
+    mountv6_profile(u, MOUNT_PHASE_SUPERBLOCK, start, 0);
+
+    return ERR_NONE;
+    
+}
+
+/**
+ * @brief fill the freshly allocated bitmaps: load them from disk, or rebuild
+ *        them from the inodes if asked to or if the on-disk ones are not usable
+ * @param u the filesystem (IN-OUT; ibm and fbm will be changed)
+ * @return 0 on success; <0 on error
+ */
+static int mountv6_fill_bitmaps(struct unix_filesystem *u)
+{
+
+    if (!u->rescan) {
+
+        int loadCheck = mountv6_load_bitmaps(u);
+
+        if (loadCheck != ERR_BITMAP_FULL)
+            return loadCheck;
+
+        debug_printf("on-disk bitmaps not usable, rebuilding them%s", "\n");
+
+        memset(u->ibm->bm, 0, u->ibm->length * sizeof(uint64_t));
+        memset(u->fbm->bm, 0, u->fbm->length * sizeof(uint64_t));
+        bm_update_summary(u->ibm);
+        bm_update_summary(u->fbm);
+
+    }
+
+    return mountv6_scan_inodes(u);
+
+}
+
+/**
+ * @brief build the bitmaps of a mounted filesystem if it does not have them yet
+ * @param u the filesystem (IN-OUT; ibm and fbm are set)
+ * @return 0 on success; <0 on error
+ */
+int mountv6_bitmaps(struct unix_filesystem *u)
+{
+
+    M_REQUIRE_NON_NULL(u);
+
+    if (u->ibm != NULL && u->fbm != NULL)
+        return ERR_NONE;
+
+    // the inodes from the root to the last one of the table, the sectors from the first data sector to the last one
+    u->ibm = bm_alloc(ROOT_INUMBER, (uint64_t) u->s.s_isize*INODES_PER_SECTOR - 1);
+    u->fbm = bm_alloc(u->s.s_block_start, (uint64_t) u->s.s_fsize - 1);
+
+    if (u->ibm != NULL && u->fbm != NULL)
+        mountv6_profile_memory(u, mountv6_bitmap_bytes(u->ibm) + mountv6_bitmap_bytes(u->fbm));
+
+    int ret = (u->ibm == NULL || u->fbm == NULL) ? ERR_BITMAP_FULL : mountv6_fill_bitmaps(u);
+
+    if (ret == ERR_NONE && u->extents)
+        ret = bm_attach_extents(u->fbm);
+
+    // all or nothing, so that a later call starts over
+    if (ret != ERR_NONE) {
+
+        bm_free(u->ibm);
+        u->ibm = NULL;
+
+        bm_free(u->fbm);
+        u->fbm = NULL;
+
+    }
+
+    return ret;
+
+}
+
+/**
+ * @brief  mount a unix v6 filesystem through the given backend
  * @param filename name of the unixv6 filesystem on the underlying disk (IN)
+ * @param opts the backend to use and whether the mount is writable (IN)
  * @param u the filesystem (OUT)
  * @return 0 on success; <0 on error
  */
-int mountv6(const char *filename, struct unix_filesystem *u)
+int mountv6_opts(const char *filename, const struct mount_options *opts, struct unix_filesystem *u)
 {
 
     M_REQUIRE_NON_NULL(filename);
+    M_REQUIRE_NON_NULL(opts);
     M_REQUIRE_NON_NULL(u);
 
     memset(u, 0, sizeof(*u));
-    u->f = fopen(filename, "r");
-    
-    if (u->f == NULL) 
-        return ERR_IO;
+    u->profile.enabled = opts->profile;
 
-    uint8_t x[512];
+    int openCheck = blockdev_open(&(u->dev), filename, opts->backend, opts->writable);
 
-    int bootSectCheck = sector_read(u->f, BOOTBLOCK_SECTOR, &x); 
+    if (openCheck != ERR_NONE) 
+        return openCheck;
 
-    if (bootSectCheck != ERR_NONE) {
-            
-        fclose(u->f);
+    u->dev.stats = &(u->stats);
 
-        return bootSectCheck;
+    // an in-memory image is its own cache
+    if (opts->cache_size > 0 && blockdev_map(&(u->dev), 0, 1) == NULL) {
 
-    }
+        u->cache = bcache_alloc(&(u->dev), opts->cache_size);
 
-    if (x[BOOTBLOCK_MAGIC_NUM_OFFSET] != BOOTBLOCK_MAGIC_NUM) {
-            
-        fclose(u->f);
+        if (u->cache == NULL) {
 
-        return ERR_BAD_BOOT_SECTOR;
+            umountv6(u);
+
+            return ERR_NOMEM;
+
+        }
+
+        // optional: without an engine, prefetching reads synchronously
+        if (opts->io_depth > 0 && blockdev_fd(&(u->dev)) >= 0)
+            u->io = ioengine_open(blockdev_fd(&(u->dev)), opts->io_depth);
 
     }
 
-    int superBlockCheck = sector_read(u->f, SUPERBLOCK_SECTOR, &(u->s));
+    u->rescan = opts->rescan;
+    u->extents = opts->extents;
 
-    if (superBlockCheck != ERR_NONE) {
+    int loadCheck = mountv6_load(u);
 
-        fclose(u->f);
+    if (loadCheck == ERR_NONE) {
+
+        // not cleanly unmounted: the on-disk bitmaps may be stale
+        if (u->s.s_fmod) {
+            u->rescan = 1;
+            u->fmod_state = MOUNT_FMOD_SET;
+        }
 
-        return superBlockCheck;
-    
     }
 
-    u->ibm = bm_alloc(ROOT_INUMBER, u->s.s_isize*INODES_PER_SECTOR);
+    if (loadCheck == ERR_NONE && !opts->lazy)
+        loadCheck = mountv6_bitmaps(u);
+
+    if (loadCheck != ERR_NONE)
+        umountv6(u);
+
+    return loadCheck;
+
+}
+
+/**
+ * @brief  record that a writable filesystem is about to change its bitmaps,
+ *         setting s_fmod on disk the first time
+ * @param u the filesystem (IN-OUT)
+ * @return 0 on success; <0 on error
+ */
+int mountv6_modified(struct unix_filesystem *u)
+{
+
+    M_REQUIRE_NON_NULL(u);
+
+    if (!u->dev.writable)
+        return ERR_NONE;
+
+    int state = MOUNT_FMOD_CLEAN;
+
+    if (__atomic_compare_exchange_n(&(u->fmod_state), &state, MOUNT_FMOD_WRITING, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+
+        // dirty until umountv6() has written the bitmaps back
+        uint64_t start = mountv6_clock(u);
+        u->s.s_fmod = 1;
+
+        int ret = mountv6_sync_superblock(u);
 
-    if (u->ibm == NULL) return ERR_BITMAP_FULL;
+        mountv6_profile(u, MOUNT_PHASE_SUPERBLOCK, start, 0);
 
-    for (uint16_t inr = 1; inr < u->s.s_isize*INODES_PER_SECTOR; inr++) {
+        if (ret != ERR_NONE)
+            u->s.s_fmod = 0;
 
-        struct inode inode;
+        __atomic_store_n(&(u->fmod_state), (ret == ERR_NONE) ? MOUNT_FMOD_SET : MOUNT_FMOD_CLEAN, __ATOMIC_RELEASE);
 
-        int inodeReadCheck = inode_read(u, inr, &inode);
+        return ret;
 
-        if (inodeReadCheck != ERR_UNALLOCATED_INODE && (inode.i_mode & IALLOC))
-            bm_set(u->ibm, inr);
+    }
 
+    // another thread is setting it: no change may reach the disk before it does
+    while (state == MOUNT_FMOD_WRITING) {
+        sched_yield();
+        state = __atomic_load_n(&(u->fmod_state), __ATOMIC_ACQUIRE);
     }
 
-    u->fbm = bm_alloc(u->s.s_block_start, u->s.s_fsize);
+    return (state == MOUNT_FMOD_SET) ? ERR_NONE : mountv6_modified(u);
 
-    if (u->fbm == NULL) return ERR_BITMAP_FULL;
+}
 
-    for (uint16_t inr = 1; inr < u->s.s_isize*INODES_PER_SECTOR; inr++) {
+/**
+ * @brief  mount a unix v6 filesystem, read-only
+ * @param filename name of the unixv6 filesystem on the underlying disk (IN)
+ * @param u the filesystem (OUT)
+ * @return 0 on success; <0 on error
+ */
+int mountv6(const char *filename, struct unix_filesystem *u)
+{
 
-        struct inode inode;
+    // read-only, as fopen(filename, "r") was: writers ask for it through mountv6_opts()
+    const struct mount_options opts = { .backend = BLOCKDEV_STDIO, .writable = 0, .cache_size = BCACHE_DEFAULT_SIZE };
 
-        int inodeReadCheck = inode_read(u, inr, &inode);
+    return mountv6_opts(filename, &opts, u);
 
-        if (inodeReadCheck == ERR_UNALLOCATED_INODE || !(inode.i_mode & IALLOC))
-            continue;
+}
 
-        int offset = 0;
+/**
+ * @brief  mount a unix v6 filesystem read-only by mapping the whole image in memory
+ * @param filename name of the unixv6 filesystem on the underlying disk (IN)
+ * @param u the filesystem (OUT)
+ * @return 0 on success; <0 on error
+ */
+int mountv6_mmap(const char *filename, struct unix_filesystem *u)
+{
 
-        while (1) {
-            
-            if (inode_getsize(&inode) - offset == 0)
-                break;
-            
-            int sector = inode_findsector(u, &inode, offset);
+    const struct mount_options opts = { .backend = BLOCKDEV_MMAP, .writable = 0 };
 
-            if (sector < ERR_NONE) {
+    return mountv6_opts(filename, &opts, u);
 
-                if (sector == ERR_OFFSET_OUT_OF_RANGE)
-                    break;
+}
 
-                free(u->ibm);
-                u->ibm = NULL;
-                
-                free(u->fbm);
-                u->fbm = NULL;
+/**
+ * @brief print the cost of each mount phase and the bitmap memory peak to stdout
+ * @param u the filesystem, mounted with mount_options.profile (possibly since unmounted) (IN)
+ */
+void mountv6_print_profile(const struct unix_filesystem *u)
+{
 
-                return sector;
+    if (u == NULL)
+        return;
 
-            }
+    uint64_t totalNs = 0, totalSectors = 0;
 
-            bm_set(u->fbm, sector); // sector is not right i think? (works with simple.uv6 but not aiw.uv6)
+    pps_printf("**********MOUNT PROFILE START**********\n");
 
-            int remaining = (inode_getsize(&inode) - offset < SECTOR_SIZE);
+    for (int phase = 0; phase < MOUNT_NB_PHASES; phase++) {
 
-            offset += (remaining) ? inode_getsize(&inode) : offset + SECTOR_SIZE;
+        pps_printf("%-20s: %12" PRIu64 " ns %8" PRIu64 " sectors\n", MOUNT_PHASE_NAMES[phase],
+                   u->profile.ns[phase], u->profile.sectors[phase]);
 
-        }
+        totalNs += u->profile.ns[phase];
+        totalSectors += u->profile.sectors[phase];
 
     }
 
-    return ERR_NONE;
-    
+    pps_printf("%-20s: %12" PRIu64 " ns %8" PRIu64 " sectors\n", "total", totalNs, totalSectors);
+    pps_printf("%-20s: %zu bytes\n", "bitmap memory peak", u->profile.bitmap_peak);
+    pps_printf("**********MOUNT PROFILE END************\n");
+
 }
 
 /**
- * @brief unmount the given filesystem
+ * @brief unmount the given filesystem, writing back the sectors still dirty in its cache;
+ *        a writable mount also writes its bitmaps to disk and clears s_fmod
  * @param u - the mounted filesytem
  * @return 0 on success; <0 on error
  */
@@ -139,18 +817,160 @@ int umountv6(struct unix_filesystem *u)
 {
     M_REQUIRE_NON_NULL(u);
 
-    if (u->f == NULL) return ERR_IO;
+    if (u->dev.ops == NULL) return ERR_IO;
+
+    int ret = ERR_NONE;
+
+    ioengine_close(u->io);
+    u->io = NULL;
+
+    // s_fmod is only set on disk by writable mounts, see mountv6_modified()
+    if (u->dev.writable && u->s.s_fmod) {
+
+        if (u->ibm != NULL && u->fbm != NULL) {
 
-    int ret = fclose(u->f);
+            ret = mountv6_write_bitmap(u, u->ibm, u->s.s_ibm_start, u->s.s_ibmsize);
 
-    free(u->ibm);
+            if (ret == ERR_NONE)
+                ret = mountv6_write_bitmap(u, u->fbm, u->s.s_fbm_start, u->s.s_fbmsize);
+
+        }
+
+        // never built (lazy mount): the on-disk bitmaps are as good as they were at mount
+        if (ret == ERR_NONE && (u->ibm != NULL || !u->rescan)) {
+            u->s.s_fmod = 0;
+            ret = mountv6_sync_superblock(u);
+        }
+
+    }
+
+    if (u->cache != NULL) {
+
+        debug_printf("unmounting with %zu cached sectors\n", u->cache->capacity);
+
+        int flushCheck = bcache_flush(u->cache);
+
+        if (ret == ERR_NONE)
+            ret = flushCheck;
+
+        // after the flush, so that the last write-back is counted
+        u->cache_stats = u->cache->stats;
+
+        bcache_free(u->cache);
+        u->cache = NULL;
+
+    }
+
+    int closeCheck = blockdev_close(&(u->dev));
+
+    if (ret == ERR_NONE)
+        ret = closeCheck;
+
+    bm_free(u->ibm);
     u->ibm = NULL;
 
-    free(u->fbm);
+    bm_free(u->fbm);
     u->fbm = NULL;
 
-    memset(u, 0, sizeof(struct unix_filesystem));
+    // everything else is reset above; the I/O statistics stay readable
+    memset(&(u->s), 0, sizeof(struct superblock));
     
-    return (ret != 0) ? ERR_IO : ERR_NONE;
+    return ret;
+
+}
+
+/**
+ * @brief create a new filesystem. Only the sectors up to the first inode one
+ *        and the first data sector, which holds the entries of the root
+ *        directory, hold anything but zeros: they are written in two writes,
+ *        and the rest of the image (inode table, data) is left to ftruncate(),
+ *        which creates it sparse, so the cost does not depend on num_blocks.
+ *        Layout: boot sector, superblock, inode bitmap, block bitmap, inodes, data.
+ * @param filename name of the image to create or overwrite (IN)
+ * @param num_blocks the total number of blocks (= max size of disk), in sectors
+ * @param num_inodes the total number of inodes
+ * @return 0 on success; <0 on error
+ */
+int mountv6_mkfs(const char *filename, uint16_t num_blocks, uint16_t num_inodes)
+{
+    M_REQUIRE_NON_NULL(filename);
+
+    if (num_inodes <= ROOT_INUMBER) return ERR_BAD_PARAMETER;
+
+    const uint32_t bitsPerSector = SECTOR_SIZE * 8;
+    const uint32_t isize = (uint32_t) ((num_inodes + INODES_PER_SECTOR - 1) / INODES_PER_SECTOR);
+    // the bitmaps cover as many elements as mountv6_bitmaps() allocates
+    const uint32_t ibmsize = (uint32_t) (isize * INODES_PER_SECTOR + bitsPerSector - 1) / bitsPerSector;
+    const uint32_t fbmsize = (num_blocks + bitsPerSector - 1) / bitsPerSector;
+    // the block bitmap first, see the layout in unixv6fs.h
+    const uint32_t fbmStart = SUPERBLOCK_SECTOR + 1;
+    const uint32_t ibmStart = fbmStart + fbmsize;
+    const uint32_t inodeStart = ibmStart + ibmsize;
+    const uint32_t blockStart = inodeStart + isize;
+
+    if (blockStart >= num_blocks) return ERR_BAD_PARAMETER;
+
+    // every sector up to the one holding the root inode
+    const uint32_t count = inodeStart + 1;
+    uint8_t *data = calloc(count, SECTOR_SIZE);
+
+    if (data == NULL) return ERR_NOMEM;
+
+    data[BOOTBLOCK_MAGIC_NUM_OFFSET] = BOOTBLOCK_MAGIC_NUM;
+
+    struct superblock *s = (struct superblock *) (data + SUPERBLOCK_SECTOR * SECTOR_SIZE);
+    s->s_isize = (uint16_t) isize;
+    s->s_fsize = num_blocks;
+    s->s_fbmsize = (uint16_t) fbmsize;
+    s->s_ibmsize = (uint16_t) ibmsize;
+    s->s_inode_start = (uint16_t) inodeStart;
+    s->s_block_start = (uint16_t) blockStart;
+    s->s_fbm_start = (uint16_t) fbmStart;
+    s->s_ibm_start = (uint16_t) ibmStart;
+
+    // the bitmaps start at ROOT_INUMBER and s_block_start, see mountv6_read_bitmap():
+    // the root inode and the first data sector, which holds its entries, are used
+    data[ibmStart * SECTOR_SIZE] = 1;
+    data[fbmStart * SECTOR_SIZE] = 1;
+
+    // the root directory: "." and "..", both itself
+    struct direntv6 entries[DIRENTRIES_PER_SECTOR];
+    memset(entries, 0, sizeof(entries));
+    entries[0].d_inumber = ROOT_INUMBER;
+    strncpy(entries[0].d_name, ".", DIRENT_MAXLEN);
+    entries[1].d_inumber = ROOT_INUMBER;
+    strncpy(entries[1].d_name, "..", DIRENT_MAXLEN);
+
+    struct inode *root = (struct inode *) (data + inodeStart * SECTOR_SIZE) + ROOT_INUMBER;
+    root->i_mode = IALLOC | IFDIR | IREAD | IWRITE | IEXEC;
+    root->i_size1 = (uint16_t) (2 * sizeof(struct direntv6));
+    root->i_addr[0] = (uint16_t) blockStart;
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+
+        free(data);
+        data = NULL;
+
+        return ERR_IO;
+
+    }
+
+    int ret = sector_pwrite_range(fd, 0, count, data);
+
+    if (ret == ERR_NONE)
+        ret = sector_pwrite_range(fd, blockStart, 1, entries);
+
+    free(data);
+    data = NULL;
+
+    if (ret == ERR_NONE && ftruncate(fd, (off_t) num_blocks * SECTOR_SIZE) != 0)
+        ret = ERR_IO;
+
+    if (close(fd) != 0 && ret == ERR_NONE)
+        ret = ERR_IO;
+
+    return ret;
 
 }
@@ -11,12 +11,65 @@
 #include <stdio.h>
 #include "unixv6fs.h"
 #include "bmblock.h"
+#include "blockdev.h"
+#include "bcache.h"
+
+/* the phases of a mount, in order, see struct mount_profile */
+enum mount_phase {
+    MOUNT_PHASE_BOOT,              /* boot sector check */
+    MOUNT_PHASE_SUPERBLOCK,        /* superblock load, and the s_fmod update of the first change */
+    MOUNT_PHASE_INODE_BITMAP,      /* on-disk inode bitmap, or inode table walk of a rescan */
+    MOUNT_PHASE_BLOCK_BITMAP,      /* on-disk block bitmap, or merge of the per-thread ones of a rescan */
+    MOUNT_PHASE_BLOCK_MAP,         /* indirect sectors of the large files, on a rescan */
+    MOUNT_NB_PHASES
+};
+
+/*
+ * Cost of each mount phase, including the bitmaps built later by a lazy mount.
+ * On a parallel rescan, the inode table walk and the block map resolution
+ * interleave in every thread: their times are those of the slowest thread.
+ */
+struct mount_profile {
+    int enabled;                       /* set by mount_options.profile */
+    uint64_t ns[MOUNT_NB_PHASES];      /* wall time */
+    uint64_t sectors[MOUNT_NB_PHASES]; /* sectors read; the boot sector check reads the superblock too */
+    size_t bitmap_peak;                /* most bytes held at once by the bitmaps, scan copies included */
+};
 
 struct unix_filesystem {
-    FILE *f;
+    struct blockdev dev;           /* the disk image, accessed through its backend */
+    struct bcache *cache;          /* sector cache in front of dev; NULL for in-memory backends */
+    struct ioengine *io;           /* asynchronous reads into the cache; NULL if not available */
+    struct iostats stats;          /* the I/O that reached dev; still readable after umountv6() */
+    struct bcache_stats cache_stats; /* the counters of cache, copied by umountv6() (zero without a cache) */
+    struct mount_profile profile;  /* cost of the mount phases; still readable after umountv6() */
     struct superblock s;           /* copy of the superblock */
     struct bmblock_array *fbm;     /* block bitmap -- ignore before WEEK 10 */
     struct bmblock_array *ibm;     /* inode bitmap  -- ignore before WEEK 10 */
+    int rescan;                    /* how mountv6_bitmaps() builds the bitmaps, see mount_options */
+    int extents;                   /* whether mountv6_bitmaps() indexes fbm by extent, see mount_options */
+    int fmod_state;                /* whether s_fmod is set on disk yet, see mountv6_modified() */
+};
+
+// values of unix_filesystem.fmod_state
+#define MOUNT_FMOD_CLEAN 0   // s_fmod is clear on disk
+#define MOUNT_FMOD_WRITING 1 // a thread is setting it
+#define MOUNT_FMOD_SET 2     // it is set on disk
+
+struct mount_options {
+    enum blockdev_type backend;    /* how the disk image is accessed */
+    int writable;                  /* 0 for a read-only mount */
+    size_t cache_size;             /* number of sectors cached, 0 for no cache;
+                                    * ignored by the in-memory (mmap and ram) backends */
+    unsigned io_depth;             /* reads kept in flight by prefetching, 0 for synchronous reads;
+                                    * only used with a cache on a file-based backend (stdio, pread) */
+    int rescan;                    /* 1 to rebuild the bitmaps from the inodes (recovery) instead of
+                                    * loading them from s_ibm_start and s_fbm_start */
+    int lazy;                      /* 1 to leave ibm and fbm NULL until mountv6_bitmaps() is called,
+                                    * e.g. by the first allocation; for commands that never allocate */
+    int profile;                   /* 1 to record the cost of each mount phase in u->profile */
+    int extents;                   /* 1 to index the free sectors of fbm by extent once it is built,
+                                    * so that sectors are allocated by best fit (see bm_attach_extents()) */
 };
 
 
@@ -25,7 +78,9 @@ struct unix_filesystem {
  * TODO WEEK 10: Add bitmaps					   	   *
  * *************************************************** */
 /**
- * @brief  mount a unix v6 filesystem
+ * @brief  mount a unix v6 filesystem, read-only through stdio (BLOCKDEV_STDIO backend)
+ *         with a sector cache of BCACHE_DEFAULT_SIZE sectors; to write to it,
+ *         mount it with mountv6_opts() and mount_options.writable
  * @param filename name of the unixv6 filesystem on the underlying disk (IN)
  * @param u the filesystem (OUT)
  * @return 0 on success; <0 on error
@@ -33,21 +88,78 @@ struct unix_filesystem {
 int mountv6(const char *filename, struct unix_filesystem *u);
 
 
+/**
+ * @brief  mount a unix v6 filesystem through the given backend. The inode and
+ *         block bitmaps are read from their on-disk sectors, unless opts->rescan
+ *         is set, the filesystem was not cleanly unmounted (s_fmod set) or they
+ *         are not usable (too small, or the root inode is not marked): then
+ *         they are rebuilt by walking every inode. A writable mount sets s_fmod
+ *         on disk from its first change (see mountv6_modified()) until umountv6();
+ *         one that changes nothing leaves the image untouched.
+ * @param filename name of the unixv6 filesystem on the underlying disk (IN)
+ * @param opts the backend to use and whether the mount is writable (IN)
+ * @param u the filesystem (OUT)
+ * @return 0 on success; <0 on error
+ */
+int mountv6_opts(const char *filename, const struct mount_options *opts, struct unix_filesystem *u);
+
+/**
+ * @brief  build the inode and block bitmaps of a filesystem mounted lazily,
+ *         as mountv6_opts() does for the other mounts; does nothing if they
+ *         are already built. Not thread-safe: call it before sharing u
+ *         between threads that allocate.
+ * @param u the filesystem (IN-OUT; ibm and fbm are set)
+ * @return 0 on success; <0 on error
+ */
+int mountv6_bitmaps(struct unix_filesystem *u);
+
+/**
+ * @brief  record that a writable filesystem is about to change its bitmaps:
+ *         the first call sets s_fmod on disk, so that a crash before umountv6()
+ *         makes the next mount rebuild them; the others return at once.
+ *         Called by the allocators (inode_alloc(), file sectors) before they
+ *         claim anything; safe to call from several threads at once.
+ * @param u the filesystem (IN-OUT)
+ * @return 0 on success (nothing to do on a read-only mount); <0 on error
+ */
+int mountv6_modified(struct unix_filesystem *u);
+
+/**
+ * @brief  mount a unix v6 filesystem read-only by mapping the whole image in memory
+ *         (BLOCKDEV_MMAP backend). Any sector write fails with ERR_READ_ONLY.
+ * @param filename name of the unixv6 filesystem on the underlying disk (IN)
+ * @param u the filesystem (OUT)
+ * @return 0 on success; <0 on error
+ */
+int mountv6_mmap(const char *filename, struct unix_filesystem *u);
+
+
 /* *************************************************** *
  * TODO WEEK 04: Implement							   *
  * TODO WEEK 10: Add bitmaps					   	   *
  * *************************************************** */
 /**
- * @brief unmount the given filesystem
+ * @brief print the cost of each mount phase and the bitmap memory peak to stdout
+ * @param u the filesystem, mounted with mount_options.profile (possibly since unmounted) (IN)
+ */
+void mountv6_print_profile(const struct unix_filesystem *u);
+
+/**
+ * @brief unmount the given filesystem, writing back the sectors still dirty in its cache;
+ *        a writable mount also writes its bitmaps to disk and clears s_fmod
  * @param u - the mounted filesytem
  * @return 0 on success; <0 on error
  */
 int umountv6(struct unix_filesystem *u);
 
 /**
- * @brief create a new filesystem
+ * @brief create a new filesystem, with an empty root directory, that later mounts
+ *        trust as cleanly unmounted. The image is sparse but for
+ *        its header sectors and the sector of the root directory.
+ * @param filename name of the image to create or overwrite (IN)
  * @param num_blocks the total number of blocks (= max size of disk), in sectors
  * @param num_inodes the total number of inodes
+ * @return 0 on success; ERR_BAD_PARAMETER if the metadata would not fit; <0 on error
  */
 int mountv6_mkfs(const char *filename, uint16_t num_blocks, uint16_t num_inodes);
 
@@ -1,10 +1,12 @@
+
 #include <stdio.h>
+#include <errno.h>
+#include <unistd.h> // pread(), pwrite()
 #include "sector.h"
+#include "mount.h"
 #include "error.h"
 #include "unixv6fs.h"
 
-#define NB_SECT_TO_READ 1
-
 /**
  * @brief read one 512-byte sector from the virtual disk
  * @param f open file of the virtual disk
@@ -13,47 +15,364 @@
  * @return 0 on success; <0 on error
  */
 int sector_read(FILE *f, uint32_t sector, void *data) {
-    
-    M_REQUIRE_NON_NULL(f);
+
+    return sector_read_range(f, sector, 1, data);
+
+} 
+
+/**
+ * @brief write one 512-byte sector from the virtual disk
+ * @param f open file of the virtual disk
+ * @param sector the location (in sector units, not bytes) within the virtual disk
+ * @param data a pointer to 512-bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+int sector_write(FILE *f, uint32_t sector, const void *data) {
+
+    return sector_write_range(f, sector, 1, data);
+
+}
+
+/**
+ * @brief read a run of contiguous 512-byte sectors at an absolute offset of a file descriptor
+ * @param fd open file descriptor of the virtual disk
+ * @param sector the first sector of the run (in sector units, not bytes)
+ * @param count the number of sectors in the run
+ * @param data a pointer to count*512 bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sector_pread_range(int fd, uint32_t sector, uint32_t count, void *data) {
+
     M_REQUIRE_NON_NULL(data);
 
-    if (f == NULL)
-        return ERR_IO;
+    if (fd < 0)
+        return ERR_BAD_PARAMETER;
+
+    uint8_t *dst = data;
+    size_t left = (size_t) count * SECTOR_SIZE;
+    off_t offset = (off_t) sector * SECTOR_SIZE;
+
+    while (left > 0) {
 
-    long offset = sector * SECTOR_SIZE;
+        ssize_t nb_read = pread(fd, dst, left, offset);
 
-    int fseekCheck = fseek(f, offset, SEEK_SET);
+        if (nb_read < 0 && errno == EINTR)
+            continue;
+
+        if (nb_read <= 0)
+            return ERR_IO;
+
+        dst += nb_read;
+        left -= (size_t) nb_read;
+        offset += nb_read;
 
-    if (fseekCheck != ERR_NONE) {
-        return fseekCheck;
     }
 
-    size_t nb_read = fread(data, SECTOR_SIZE, NB_SECT_TO_READ, f);
+    return ERR_NONE;
+
+}
+
+/**
+ * @brief write a run of contiguous 512-byte sectors at an absolute offset of a file descriptor
+ * @param fd open file descriptor of the virtual disk
+ * @param sector the first sector of the run (in sector units, not bytes)
+ * @param count the number of sectors in the run
+ * @param data a pointer to count*512 bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+int sector_pwrite_range(int fd, uint32_t sector, uint32_t count, const void *data) {
+
+    M_REQUIRE_NON_NULL(data);
+
+    if (fd < 0)
+        return ERR_BAD_PARAMETER;
+
+    const uint8_t *src = data;
+    size_t left = (size_t) count * SECTOR_SIZE;
+    off_t offset = (off_t) sector * SECTOR_SIZE;
+
+    while (left > 0) {
 
-    if (nb_read != NB_SECT_TO_READ) 
-        return ERR_IO;
+        ssize_t nb_written = pwrite(fd, src, left, offset);
+
+        if (nb_written < 0 && errno == EINTR)
+            continue;
+
+        if (nb_written <= 0)
+            return ERR_IO;
+
+        src += nb_written;
+        left -= (size_t) nb_written;
+        offset += nb_written;
+
+    }
 
     return ERR_NONE;
-    
-} 
+
+}
 
 /**
- * @brief write one 512-byte sector from the virtual disk
+ * @brief read a run of contiguous 512-byte sectors from the virtual disk in a single I/O
  * @param f open file of the virtual disk
- * @param sector the location (in sector units, not bytes) within the virtual disk
- * @param data a pointer to 512-bytes of memory (IN)
+ * @param sector the first sector of the run (in sector units, not bytes)
+ * @param count the number of sectors in the run
+ * @param data a pointer to count*512 bytes of memory (OUT)
  * @return 0 on success; <0 on error
  */
-int sector_write(FILE *f, uint32_t sector, const void *data) {
+int sector_read_range(FILE *f, uint32_t sector, uint32_t count, void *data) {
+
+    M_REQUIRE_NON_NULL(f);
+    M_REQUIRE_NON_NULL(data);
+
+    // positional: no shared stream position for concurrent readers to race on
+    return sector_pread_range(fileno(f), sector, count, data);
+
+}
+
+/**
+ * @brief write a run of contiguous 512-byte sectors to the virtual disk in a single I/O
+ * @param f open file of the virtual disk
+ * @param sector the first sector of the run (in sector units, not bytes)
+ * @param count the number of sectors in the run
+ * @param data a pointer to count*512 bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+int sector_write_range(FILE *f, uint32_t sector, uint32_t count, const void *data) {
+
+    M_REQUIRE_NON_NULL(f);
+    M_REQUIRE_NON_NULL(data);
+
+    return sector_pwrite_range(fileno(f), sector, count, data);
+
+}
+
+/**
+ * @brief length of the run of contiguous sectors starting at sectors[0]
+ * @param sectors a list of sectors (IN)
+ * @param count the number of entries in sectors (>0)
+ * @return the number of entries n such that sectors[k] == sectors[0] + k for all k < n
+ */
+size_t sector_run_length(const uint32_t *sectors, size_t count) {
+
+    size_t run = 1;
+
+    while (run < count && sectors[run] == sectors[run - 1] + 1)
+        run++;
+
+    return run;
+
+}
+
+/**
+ * @brief read a list of sectors from the virtual disk, one I/O per contiguous run
+ * @param f open file of the virtual disk
+ * @param sectors the sectors to read (IN)
+ * @param count the number of entries in sectors
+ * @param data a pointer to count*512 bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sector_readv(FILE *f, const uint32_t *sectors, size_t count, void *data) {
+
+    M_REQUIRE_NON_NULL(f);
+    M_REQUIRE_NON_NULL(sectors);
+    M_REQUIRE_NON_NULL(data);
+
+    uint8_t *dst = data;
+
+    for (size_t i = 0; i < count; ) {
+
+        size_t run = sector_run_length(sectors + i, count - i);
+
+        int readCheck = sector_read_range(f, sectors[i], (uint32_t) run, dst + i * SECTOR_SIZE);
+
+        if (readCheck != ERR_NONE)
+            return readCheck;
+
+        i += run;
+
+    }
+
+    return ERR_NONE;
+
+}
+
+/**
+ * @brief write a list of sectors to the virtual disk, one I/O per contiguous run
+ * @param f open file of the virtual disk
+ * @param sectors the sectors to write (IN)
+ * @param count the number of entries in sectors
+ * @param data a pointer to count*512 bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+int sector_writev(FILE *f, const uint32_t *sectors, size_t count, const void *data) {
 
     M_REQUIRE_NON_NULL(f);
+    M_REQUIRE_NON_NULL(sectors);
     M_REQUIRE_NON_NULL(data);
 
-    int writeCheck = fwrite(data, NB_SECT_TO_READ, SECTOR_SIZE, f + sector*SECTOR_SIZE);
+    const uint8_t *src = data;
+
+    for (size_t i = 0; i < count; ) {
+
+        size_t run = sector_run_length(sectors + i, count - i);
+
+        int writeCheck = sector_write_range(f, sectors[i], (uint32_t) run, src + i * SECTOR_SIZE);
 
-    if (writeCheck < ERR_NONE)
-        return ERR_IO;
+        if (writeCheck != ERR_NONE)
+            return writeCheck;
+
+        i += run;
+
+    }
 
     return ERR_NONE;
 
 }
+
+/**
+ * @brief return a pointer to count contiguous sectors of an in-memory filesystem
+ * @param u the mounted filesystem
+ * @param sector the first sector
+ * @param count the number of sectors that will be accessed
+ * @return a read-only pointer, valid as long as u is mounted;
+ *         NULL if the sectors cannot be accessed in place
+ * The access is recorded as a read of count sectors in the statistics of the device.
+ */
+const void *fs_sector_map(const struct unix_filesystem *u, uint32_t sector, uint32_t count) {
+
+    if (u == NULL)
+        return NULL;
+
+    // a cache buffer may be recycled by another thread at any time
+    if (u->cache != NULL)
+        return NULL;
+
+    const void *src = blockdev_map(&(u->dev), sector, count);
+
+    // the caller reads the sectors in place: the time goes to its page faults, not to a request
+    if (src != NULL)
+        iostats_record(u->dev.stats, IOSTATS_READ, sector, count, 0);
+
+    return src;
+
+}
+
+/**
+ * @brief read a run of contiguous sectors of a mounted filesystem
+ * @param u the mounted filesystem
+ * @param sector the first sector of the run
+ * @param count the number of sectors in the run
+ * @param data a pointer to count*512 bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int fs_sector_read_range(const struct unix_filesystem *u, uint32_t sector, uint32_t count, void *data) {
+
+    M_REQUIRE_NON_NULL(u);
+
+    if (u->cache != NULL)
+        return bcache_read(u->cache, sector, count, data);
+
+    // reading does not change the filesystem, only the state of its device
+    return blockdev_read(&(u->dev), sector, count, data);
+
+}
+
+/**
+ * @brief read one sector of a mounted filesystem
+ * @param u the mounted filesystem
+ * @param sector the sector to read
+ * @param data a pointer to 512 bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int fs_sector_read(const struct unix_filesystem *u, uint32_t sector, void *data) {
+
+    return fs_sector_read_range(u, sector, 1, data);
+
+}
+
+/**
+ * @brief read a list of sectors of a mounted filesystem (see sector_readv())
+ * @param u the mounted filesystem
+ * @param sectors the sectors to read (IN)
+ * @param count the number of entries in sectors
+ * @param data a pointer to count*512 bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int fs_sector_readv(const struct unix_filesystem *u, const uint32_t *sectors, size_t count, void *data) {
+
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(sectors);
+    M_REQUIRE_NON_NULL(data);
+
+    if (u->cache != NULL) {
+
+        // scattered runs are read concurrently first
+        if (u->io != NULL && count > 1) {
+
+            int prefetchCheck = fs_sector_prefetch(u, sectors, count);
+
+            if (prefetchCheck != ERR_NONE)
+                return prefetchCheck;
+
+        }
+
+        uint8_t *dst = data;
+
+        for (size_t i = 0; i < count; ) {
+
+            size_t run = sector_run_length(sectors + i, count - i);
+
+            int readCheck = bcache_read(u->cache, sectors[i], (uint32_t) run, dst + i * SECTOR_SIZE);
+
+            if (readCheck != ERR_NONE)
+                return readCheck;
+
+            i += run;
+
+        }
+
+        return ERR_NONE;
+
+    }
+
+    return blockdev_readv(&(u->dev), sectors, count, data);
+
+}
+
+/**
+ * @brief bring sectors into the cache of a mounted filesystem (or the pages of
+ *        its mapped image into memory) ahead of their use
+ * @param u the mounted filesystem
+ * @param sectors the sectors that will be read soon (IN)
+ * @param count the number of entries in sectors
+ * @return 0 on success; <0 on error
+ */
+int fs_sector_prefetch(const struct unix_filesystem *u, const uint32_t *sectors, size_t count) {
+
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(sectors);
+
+    if (u->cache == NULL)
+        return blockdev_willneed(&(u->dev), sectors, count);
+
+    return bcache_prefetch(u->cache, u->io, sectors, count);
+
+}
+
+/**
+ * @brief write one sector of a mounted filesystem
+ * @param u the mounted filesystem
+ * @param sector the sector to write
+ * @param data a pointer to 512 bytes of memory (IN)
+ * @return 0 on success; ERR_READ_ONLY on a read-only mount; <0 on error
+ */
+int fs_sector_write(struct unix_filesystem *u, uint32_t sector, const void *data) {
+
+    M_REQUIRE_NON_NULL(u);
+
+    if (u->cache != NULL)
+        return bcache_write(u->cache, sector, data);
+
+    return blockdev_write(&(u->dev), sector, 1, data);
+
+}
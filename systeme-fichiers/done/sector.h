@@ -40,6 +40,154 @@ int sector_read(FILE *f, uint32_t sector, void *data);
  */
 int sector_write(FILE *f, uint32_t sector, const void *data);
 
+/**
+ * @brief read a run of contiguous 512-byte sectors from the virtual disk in a single
+ *        positional I/O: the stream position of f is neither used nor moved
+ * @param f open file of the virtual disk
+ * @param sector the first sector of the run (in sector units, not bytes)
+ * @param count the number of sectors in the run
+ * @param data a pointer to count*512 bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sector_read_range(FILE *f, uint32_t sector, uint32_t count, void *data);
+
+/**
+ * @brief write a run of contiguous 512-byte sectors to the virtual disk in a single
+ *        positional I/O, bypassing the stream buffer of f
+ * @param f open file of the virtual disk
+ * @param sector the first sector of the run (in sector units, not bytes)
+ * @param count the number of sectors in the run
+ * @param data a pointer to count*512 bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+int sector_write_range(FILE *f, uint32_t sector, uint32_t count, const void *data);
+
+/**
+ * @brief read a run of contiguous 512-byte sectors at an absolute offset of a file
+ *        descriptor, without moving (or depending on) any file position; safe to
+ *        call from several threads on the same descriptor
+ * @param fd open file descriptor of the virtual disk
+ * @param sector the first sector of the run (in sector units, not bytes)
+ * @param count the number of sectors in the run
+ * @param data a pointer to count*512 bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sector_pread_range(int fd, uint32_t sector, uint32_t count, void *data);
+
+/**
+ * @brief write a run of contiguous 512-byte sectors at an absolute offset of a
+ *        file descriptor (see sector_pread_range())
+ * @param fd open file descriptor of the virtual disk
+ * @param sector the first sector of the run (in sector units, not bytes)
+ * @param count the number of sectors in the run
+ * @param data a pointer to count*512 bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+int sector_pwrite_range(int fd, uint32_t sector, uint32_t count, const void *data);
+
+/**
+ * @brief length of the run of contiguous sectors starting at sectors[0], which
+ *        the vectored reads and writes below transfer with one I/O
+ * @param sectors a list of sectors (IN)
+ * @param count the number of entries in sectors (>0)
+ * @return the number of entries n such that sectors[k] == sectors[0] + k for all k < n
+ */
+size_t sector_run_length(const uint32_t *sectors, size_t count);
+
+/**
+ * @brief read a list of sectors from the virtual disk; the i-th sector is stored
+ *        at data + i*512. Consecutive entries that are also contiguous on disk
+ *        are merged and read with one I/O per run.
+ * @param f open file of the virtual disk
+ * @param sectors the sectors to read (IN)
+ * @param count the number of entries in sectors
+ * @param data a pointer to count*512 bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sector_readv(FILE *f, const uint32_t *sectors, size_t count, void *data);
+
+/**
+ * @brief write a list of sectors to the virtual disk; the i-th sector is taken
+ *        from data + i*512. Contiguous runs are written with one I/O each.
+ * @param f open file of the virtual disk
+ * @param sectors the sectors to write (IN)
+ * @param count the number of entries in sectors
+ * @param data a pointer to count*512 bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+int sector_writev(FILE *f, const uint32_t *sectors, size_t count, const void *data);
+
+/*
+ * Sector access on a mounted filesystem: these go through the sector
+ * cache of the filesystem, if any (see bcache.h), and then through its
+ * backend (see blockdev.h).
+ */
+struct unix_filesystem;
+
+/**
+ * @brief access sectors in place, without copying them: count contiguous sectors
+ *        of an in-memory filesystem (mmap or RAM backend)
+ * @param u the mounted filesystem
+ * @param sector the first sector
+ * @param count the number of sectors that will be accessed
+ * @return a read-only pointer, valid as long as u is mounted; NULL if the
+ *         sectors cannot be accessed in place (callers then fall back to
+ *         fs_sector_read()); the access is recorded in the statistics of the
+ *         device as a read taking no time (see iostats.h)
+ */
+const void *fs_sector_map(const struct unix_filesystem *u, uint32_t sector, uint32_t count);
+
+/**
+ * @brief read a run of contiguous sectors of a mounted filesystem
+ * @param u the mounted filesystem
+ * @param sector the first sector of the run
+ * @param count the number of sectors in the run
+ * @param data a pointer to count*512 bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int fs_sector_read_range(const struct unix_filesystem *u, uint32_t sector, uint32_t count, void *data);
+
+/**
+ * @brief read one sector of a mounted filesystem
+ * @param u the mounted filesystem
+ * @param sector the sector to read
+ * @param data a pointer to 512 bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int fs_sector_read(const struct unix_filesystem *u, uint32_t sector, void *data);
+
+/**
+ * @brief read a list of sectors of a mounted filesystem (see sector_readv())
+ * @param u the mounted filesystem
+ * @param sectors the sectors to read (IN)
+ * @param count the number of entries in sectors
+ * @param data a pointer to count*512 bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int fs_sector_readv(const struct unix_filesystem *u, const uint32_t *sectors, size_t count, void *data);
+
+/**
+ * @brief bring sectors into the cache of a mounted filesystem ahead of their use,
+ *        keeping many reads in flight when the filesystem has an I/O engine
+ *        (see bcache_prefetch()); without a cache, have the kernel read the
+ *        pages of a mapped image ahead instead (see blockdev_willneed())
+ * @param u the mounted filesystem
+ * @param sectors the sectors that will be read soon (IN)
+ * @param count the number of entries in sectors
+ * @return 0 on success; <0 on error
+ */
+int fs_sector_prefetch(const struct unix_filesystem *u, const uint32_t *sectors, size_t count);
+
+/**
+ * @brief write one sector of a mounted filesystem; with a cache, the sector
+ *        reaches the disk when it is evicted or at umountv6()
+ * @param u the mounted filesystem
+ * @param sector the sector to write
+ * @param data a pointer to 512 bytes of memory (IN)
+ * @return 0 on success; ERR_READ_ONLY on a read-only mount; <0 on error
+ */
+int fs_sector_write(struct unix_filesystem *u, uint32_t sector, const void *data);
+
 #ifdef __cplusplus
 }
 #endif
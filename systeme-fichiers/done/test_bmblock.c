@@ -0,0 +1,108 @@
+/**
+ * @file test_bmblock.c
+ * @brief checks of the bounds of the bmblock_array operations
+ *
+ * The values of an array go from min to max, both included, whatever min is:
+ * the last one can be set, counted, found and allocated like any other, and
+ * max + 1 is out of the bounds. The arrays tested are shaped like the inode
+ * bitmap (min = ROOT_INUMBER) and the block bitmap (min = s_block_start).
+ *
+ * usage: make test_bmblock && ./test_bmblock
+ * prints each failed check and exits with 1 if there is any
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include "bmblock.h"
+#include "error.h"
+
+static int test_failures = 0;
+
+#define TEST_CHECK(_cond) \
+    do { \
+        if (!(_cond)) { \
+            fprintf(stderr, "%s:%d: [min %" PRIu64 ", max %" PRIu64 "] failed: %s\n", __FILE__, __LINE__, \
+                    min, max, #_cond); \
+            ++test_failures; \
+        } \
+    } while (0)
+
+/**
+ * @brief check the last value of an array of [min, max], with and without extents
+ */
+static void test_last_value(uint64_t min, uint64_t max, int extents)
+{
+    struct bmblock_array *bm = bm_alloc(min, max);
+    TEST_CHECK(bm != NULL);
+    if (bm == NULL) {
+        return;
+    }
+
+    if (extents) {
+        TEST_CHECK(bm_attach_extents(bm) == ERR_NONE);
+    }
+
+    // every value counts, none past max
+    TEST_CHECK(bm->max == max);
+    TEST_CHECK(bm_count_free(bm) == max - min + 1);
+    TEST_CHECK(bm_count_set(bm) == 0);
+    TEST_CHECK(bm_largest_free(bm) == max - min + 1);
+    TEST_CHECK(bm_get(bm, max) == 0);
+    TEST_CHECK(bm_get(bm, max + 1) == ERR_BAD_PARAMETER);
+    TEST_CHECK(bm_get(bm, min - 1) == ERR_BAD_PARAMETER);
+
+    // the last value can be set, counted and cleared
+    bm_set(bm, max);
+    TEST_CHECK(bm_get(bm, max) == 1);
+    TEST_CHECK(bm_count_set(bm) == 1);
+    TEST_CHECK(bm_count_free(bm) == max - min);
+
+    bm_set(bm, max + 1);
+    TEST_CHECK(bm_count_set(bm) == 1);
+
+    bm_clear(bm, max);
+    TEST_CHECK(bm_get(bm, max) == 0);
+    TEST_CHECK(bm_count_set(bm) == 0);
+
+    // once all the others are set, it is the one found and allocated
+    bm_set_range(bm, min, max - min);
+    TEST_CHECK(bm_count_free(bm) == 1);
+    TEST_CHECK(bm_find_next(bm) == (int) max);
+    TEST_CHECK(bm_find_next_from(bm, min) == (int) max);
+
+    uint64_t cursor = BM_CURSOR_UNSET;
+    TEST_CHECK(bm_claim_next(bm, &cursor) == (int) max);
+    TEST_CHECK(bm_count_free(bm) == 0);
+    TEST_CHECK(bm_find_next(bm) == ERR_BITMAP_FULL);
+    TEST_CHECK(bm_claim_next(bm, &cursor) == ERR_BITMAP_FULL);
+
+    // and given back
+    bm_release(bm, max);
+    TEST_CHECK(bm_count_free(bm) == 1);
+    TEST_CHECK(bm_try_claim(bm, max, 1) == ERR_NONE);
+    TEST_CHECK(bm_try_claim(bm, max, 2) == ERR_BAD_PARAMETER);
+
+    bm_free(bm);
+}
+
+int main(void)
+{
+    // { min, max }: one value, exactly one word, a word and a bit, bitmaps of u6fs images
+    static const uint64_t bounds[][2] = {
+        { 1, 1 }, { 1, 64 }, { 1, 65 }, { 12, 75 }, { 1, 1023 }, { 12, 1999 }, { 138, 65535 }
+    };
+
+    for (size_t i = 0; i < sizeof(bounds) / sizeof(bounds[0]); ++i) {
+        for (int extents = 0; extents <= 1; ++extents) {
+            test_last_value(bounds[i][0], bounds[i][1], extents);
+        }
+    }
+
+    if (test_failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", test_failures);
+        return 1;
+    }
+
+    printf("all checks passed\n");
+    return 0;
+}
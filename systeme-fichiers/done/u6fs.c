@@ -17,6 +17,12 @@
 #include "direntv6.h"
 #include "u6fs_fuse.h"
 
+#define U6FS_BACKEND_ENV "U6FS_BACKEND" // environment variable to force the disk backend
+#define U6FS_STATS_ENV "U6FS_STATS"     // environment variable to report the I/O after any command
+#define U6FS_RESCAN_ENV "U6FS_RESCAN"   // environment variable to rebuild the bitmaps from the inodes
+#define U6FS_PROFILE_ENV "U6FS_PROFILE" // environment variable to report the cost of each mount phase
+#define U6FS_EXTENTS_ENV "U6FS_EXTENTS" // environment variable to allocate sectors by best fit among the free extents
+
 /* *************************************************** *
  * TODO WEEK 04-07: Add more messages                  *
  * *************************************************** */
@@ -31,7 +37,16 @@ static void usage(const char *execname, int err)
         pps_printf("%s <disk> tree\n", execname);
         pps_printf("%s <disk> fuse <mountpoint>\n", execname);
         pps_printf("%s <disk> bm\n", execname);
+        pps_printf("%s <disk> df\n", execname);
         pps_printf("%s <disk> mkdir </path/to/newdir>\n", execname);
+        pps_printf("%s <disk> stats\n", execname);
+        pps_printf("%s <disk> mkfs <num_blocks> <num_inodes>\n", execname);
+        pps_printf("the disk backend can be forced with %s=stdio|pread|mmap|ram|direct\n", U6FS_BACKEND_ENV);
+        pps_printf("(pread by default, stdio for mkdir; mmap and ram read in place, without the sector cache)\n");
+        pps_printf("the I/O statistics and the sector cache counters are printed after any command with %s=1\n", U6FS_STATS_ENV);
+        pps_printf("the bitmaps are rebuilt from the inodes instead of read from disk with %s=1\n", U6FS_RESCAN_ENV);
+        pps_printf("the cost of each mount phase is printed after any command with %s=1\n", U6FS_PROFILE_ENV);
+        pps_printf("sectors are allocated by best fit among the free extents with %s=1\n", U6FS_EXTENTS_ENV);
     } else if (err > ERR_FIRST && err < ERR_LAST) {
         pps_printf("%s: Error: %s\n", execname, ERR_MESSAGES[err - ERR_FIRST]);
     } else {
@@ -54,8 +69,54 @@ int u6fs_do_one_cmd(int argc, char *argv[])
 {
     if (argc < 3) return ERR_INVALID_COMMAND;
 
+    // creates the disk instead of mounting it
+    if (CMD("mkfs", 5)) {
+
+        int blocks = atoi(argv[3]), inodes = atoi(argv[4]);
+
+        if (blocks <= 0 || blocks > UINT16_MAX || inodes <= 0 || inodes > UINT16_MAX)
+            return ERR_BAD_PARAMETER;
+
+        return mountv6_mkfs(argv[1], (uint16_t) blocks, (uint16_t) inodes);
+
+    }
+
     struct unix_filesystem u = {0};
-    int error = mountv6(argv[1], &u), err2 = 0;
+
+    // every command but mkdir only reads the disk: positional reads through the sector cache,
+    // so that its read-ahead and asynchronous reads serve them, and only build the bitmaps for
+    // the commands that use them
+    struct mount_options opts = { .backend = BLOCKDEV_PREAD, .writable = 0, .lazy = 1 };
+
+    if (strcmp(argv[2], "mkdir") == 0) {
+        opts.backend = BLOCKDEV_STDIO;
+        opts.writable = 1;
+    }
+
+    // fuse builds them before its threads start allocating
+    if (strcmp(argv[2], "bm") == 0 || strcmp(argv[2], "df") == 0 || strcmp(argv[2], "fuse") == 0)
+        opts.lazy = 0;
+
+    opts.cache_size = BCACHE_DEFAULT_SIZE;
+    opts.io_depth = IOENGINE_DEFAULT_DEPTH;
+    opts.rescan = (getenv(U6FS_RESCAN_ENV) != NULL);
+    opts.profile = (getenv(U6FS_PROFILE_ENV) != NULL);
+    opts.extents = (getenv(U6FS_EXTENTS_ENV) != NULL);
+
+    const char *backend = getenv(U6FS_BACKEND_ENV);
+
+    if (backend != NULL) {
+
+        int type = blockdev_type_from_name(backend);
+
+        if (type < ERR_NONE)
+            return type;
+
+        opts.backend = (enum blockdev_type) type;
+
+    }
+
+    int error = mountv6_opts(argv[1], &opts, &u), err2 = 0;
 
     if (error != ERR_NONE) {
         debug_printf("Could not mount fs%s", "\n");
@@ -99,10 +160,19 @@ int u6fs_do_one_cmd(int argc, char *argv[])
 
         error = utils_print_bitmaps(&u);
 
+    } else if (CMD("df", 3)) {
+
+        error = utils_print_df(&u);
+
     } else if (CMD("mkdir", 4)) {
 
         error = direntv6_create(&u, argv[3], IWRITE); // mode might be wrong
         
+    } else if (CMD("stats", 3)) {
+
+        // the report below then covers the I/O of mounting alone
+        error = ERR_NONE;
+
     } else {
 
         error = ERR_INVALID_COMMAND;
@@ -110,6 +180,16 @@ int u6fs_do_one_cmd(int argc, char *argv[])
     }
 
     err2 = umountv6(&u);
+
+    // after umountv6(), so that the final write-back is included
+    if (error == ERR_NONE && (CMD("stats", 3) || getenv(U6FS_STATS_ENV) != NULL)) {
+        iostats_print(&(u.stats));
+        bcache_print_stats(&(u.cache_stats));
+    }
+
+    if (error == ERR_NONE && opts.profile)
+        mountv6_print_profile(&u);
+
     return (error == ERR_NONE ? err2 : error);
 }
 
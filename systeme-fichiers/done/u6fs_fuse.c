@@ -163,10 +163,34 @@ int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_
     return remaining;
 }
 
+int fs_statfs(const char *path _unused, struct statvfs *stbuf)
+{
+    M_REQUIRE_NON_NULL(stbuf);
+    M_REQUIRE_NON_NULL(theFS);
+    M_REQUIRE_NON_NULL(theFS->ibm);
+    M_REQUIRE_NON_NULL(theFS->fbm);
+
+    memset(stbuf, 0, sizeof(*stbuf));
+
+    stbuf->f_bsize = SECTOR_SIZE;
+    stbuf->f_frsize = SECTOR_SIZE;
+    // the data sectors, as df: the boot sector, superblock, bitmaps and inodes are never free
+    stbuf->f_blocks = bm_count_set(theFS->fbm) + bm_count_free(theFS->fbm);
+    stbuf->f_bfree = bm_count_free(theFS->fbm);
+    stbuf->f_bavail = stbuf->f_bfree;
+    stbuf->f_files = bm_count_set(theFS->ibm) + bm_count_free(theFS->ibm);
+    stbuf->f_ffree = bm_count_free(theFS->ibm);
+    stbuf->f_favail = stbuf->f_ffree;
+    stbuf->f_namemax = DIRENT_MAXLEN;
+
+    return ERR_NONE;
+}
+
 static struct fuse_operations available_ops = {
     .getattr = fs_getattr,
     .readdir = fs_readdir,
     .read    = fs_read,
+    .statfs  = fs_statfs,
 };
 
 int u6fs_fuse_main(struct unix_filesystem *u, const char *mountpoint)
@@ -176,7 +200,6 @@ int u6fs_fuse_main(struct unix_filesystem *u, const char *mountpoint)
     theFS = u;  // /!\ GLOBAL ASSIGNMENT
     const char *argv[] = {
         "u6fs",
-        "-s",               // * `-s` : single threaded operation
         "-f",              // foreground operation (no fork).  alternative "-d" for more debug messages
         "-odirect_io",      //  no caching in the kernel.
 #ifdef DEBUG
@@ -54,6 +54,15 @@ int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset
  */
 int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 
+/**
+ * @brief fills a statvfs struct with the size of the filesystem and its free
+ *        sectors and inodes, from the counts kept by the bitmaps
+ * @param path ignored
+ * @param stbuf statvfs struct to fill
+ * @return 0 on success, <0 on error
+ */
+int fs_statfs(const char *path, struct statvfs *stbuf);
+
 #ifdef CS212_TEST
 // Sets the filesystem used by fs_* functions
 // ONLY USED BY TEST FUNCTIONS
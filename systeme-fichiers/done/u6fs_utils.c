@@ -111,11 +111,11 @@ int utils_cat_first_sector(const struct unix_filesystem *u, uint16_t inr) {
 
         pps_printf("the first sector of data of which contains:\n");
 
-        char x[SECTOR_SIZE-1]; 
+        char x[SECTOR_SIZE + 1]; 
 
-        int readBlockCheck = filev6_readblock(fv6, &x);
+        int readBlockCheck = filev6_readblock(fv6, x);
 
-        if (readBlockCheck != ERR_NONE) {
+        if (readBlockCheck < ERR_NONE) {
 
             free(fv6);
             fv6 = NULL;
@@ -124,6 +124,8 @@ int utils_cat_first_sector(const struct unix_filesystem *u, uint16_t inr) {
         
         }
 
+        x[readBlockCheck] = '\0';
+
         pps_printf("%s", x);
 
         pps_printf("----\n");
@@ -179,9 +181,9 @@ int utils_print_shafile(const struct unix_filesystem *u, uint16_t inr) {
 
         size_t size = 0;
 
-        for (int i = 0; i < UTILS_HASHED_LENGTH; i += SECTOR_SIZE) {
+        while (size < UTILS_HASHED_LENGTH) {
 
-            int readBlockCheck = filev6_readblock(fv6, buf + i);
+            int readBlockCheck = filev6_readblocks(fv6, buf + size, (UTILS_HASHED_LENGTH - size) / SECTOR_SIZE);
 
             if (readBlockCheck < 0) {
 
@@ -192,11 +194,11 @@ int utils_print_shafile(const struct unix_filesystem *u, uint16_t inr) {
 
             }
 
-            size += readBlockCheck;
-
-            if (readBlockCheck < SECTOR_SIZE) 
+            if (readBlockCheck == 0)
                 break;
 
+            size += (size_t) readBlockCheck;
+
         }
 
         utils_print_SHA_buffer(buf, size);
@@ -252,3 +254,23 @@ int utils_print_bitmaps(const struct unix_filesystem *u) {
     return ERR_NONE;
 
 }
+
+int utils_print_df(const struct unix_filesystem *u)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(u->ibm);
+    M_REQUIRE_NON_NULL(u->fbm);
+
+    pps_printf("**********FS USAGE START**********\n");
+    pps_printf("%-20s: %" PRIu64 "\n", "inodes", bm_count_set(u->ibm) + bm_count_free(u->ibm));
+    pps_printf("%-20s: %" PRIu64 "\n", "  used", bm_count_set(u->ibm));
+    pps_printf("%-20s: %" PRIu64 "\n", "  free", bm_count_free(u->ibm));
+    pps_printf("%-20s: %" PRIu64 "\n", "data sectors", bm_count_set(u->fbm) + bm_count_free(u->fbm));
+    pps_printf("%-20s: %" PRIu64 "\n", "  used", bm_count_set(u->fbm));
+    pps_printf("%-20s: %" PRIu64 "\n", "  free", bm_count_free(u->fbm));
+    pps_printf("%-20s: %" PRIu64 "\n", "  free bytes", bm_count_free(u->fbm) * SECTOR_SIZE);
+    pps_printf("%-20s: %" PRIu64 "\n", "  largest free run", bm_largest_free(u->fbm));
+    pps_printf("**********FS USAGE END**********\n");
+
+    return ERR_NONE;
+}
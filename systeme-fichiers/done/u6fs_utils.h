@@ -74,3 +74,11 @@ int utils_print_sha_allfiles(const struct unix_filesystem *u);
  * @return 0 on success, <0 on error
  */
 int utils_print_bitmaps(const struct unix_filesystem *u);
+
+/**
+ * @brief print to stdout the used and free inodes and sectors, from the counts
+ *        kept by the bitmaps
+ * @param u - the mounted filesystem, with its bitmaps built
+ * @return 0 on success, <0 on error
+ */
+int utils_print_df(const struct unix_filesystem *u);